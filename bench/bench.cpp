@@ -0,0 +1,255 @@
+//______________________________________________________________________
+//
+// Host benchmark of the stream operators and MQTT codec flows.
+// Reports per event : wall time, heap allocations and heap bytes, and
+// MqttBuffer pool fallbacks which malloc() without passing operator new.
+//
+//    make -C bench run
+//
+// Numbers are host numbers, use them to compare operators and to see
+// regressions between commits, not as absolute ESP32 timings.
+//______________________________________________________________________
+#include <Streams.h>
+#include <Pipeline.h>
+#include <MqttCodec.h>
+#include <deque>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+Log logger(1024);
+//______________________________________________________________________
+//
+// global allocation counters, every new/delete in the process passes here
+//
+static uint64_t allocCount = 0;
+static uint64_t allocBytes = 0;
+
+void* operator new(size_t size)
+{
+    allocCount++;
+    allocBytes += size;
+    void* p = malloc(size ? size : 1);
+    if(p == 0) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+//______________________________________________________________________
+//
+// sink that keeps the compiler from optimizing the chain away
+//
+template <class T>
+class CountSink : public Sink<T>
+{
+public:
+    uint64_t count = 0;
+    void onNext(const T&) { count++; }
+};
+
+static uint32_t events = 1000000;
+static uint32_t sample(uint32_t i) { return (i * 7919) % 1024; } // pot like noise
+
+template <class F>
+void bench(const char* name, F f)
+{
+    for(uint32_t i = 0; i < 1000; i++) f(i); // warm up, first time allocations
+    uint64_t count = allocCount;
+    uint64_t bytes = allocBytes;
+    uint32_t fallbacks = MqttBuffer::fallbacks();
+    auto start = std::chrono::steady_clock::now();
+    for(uint32_t i = 0; i < events; i++) f(i);
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    printf("%-52s %10.1f ns/event %8.2f allocs/event %10.1f bytes/event %6.2f fallbacks/event\n",
+           name, ns / events, (double)(allocCount - count) / events,
+           (double)(allocBytes - bytes) / events,
+           (double)(MqttBuffer::fallbacks() - fallbacks) / events);
+}
+//______________________________________________________________________
+//
+int main(int argc, char** argv)
+{
+    if(argc > 1) events = atoi(argv[1]);
+    printf("%u events per benchmark\n", events);
+
+    {
+        ValueFlow<int> source;
+        CountSink<int> sink;
+        source >> sink;
+        bench("Source::emit", [&](uint32_t i) { source.emit(i); });
+    }
+    {
+        ValueFlow<int> source;
+        ValueFlow<int> flow;
+        CountSink<int> sink;
+        source >> flow >> sink;
+        bench("ValueFlow", [&](uint32_t i) { source.emit(i); });
+    }
+    {
+        Median<int, 5> median;
+        CountSink<int> sink;
+        median >> sink;
+        bench("Median<int,5>", [&](uint32_t i) { median.onNext(sample(i)); });
+    }
+    {
+        Median<int, 5> median;
+        CountSink<int> sink;
+        median >> sink;
+        int block[EMIT_BATCH];
+        bench("Median<int,5> onNextBatch per value", [&](uint32_t i) {
+            block[i % EMIT_BATCH] = sample(i);
+            if(i % EMIT_BATCH == EMIT_BATCH - 1) median.onNextBatch(block, EMIT_BATCH);
+        });
+    }
+    {
+        MovingAverage<double> average(10, 100);
+        CountSink<double> sink;
+        average >> sink;
+        bench("MovingAverage<double>(10)", [&](uint32_t i) { average.onNext(sample(i)); });
+    }
+    {
+        Throttle<int> throttle(100);
+        CountSink<int> sink;
+        throttle >> sink;
+        bench("Throttle<int>(100)", [&](uint32_t i) { throttle.onNext(i); });
+    }
+    {
+        ChangeFlow<int> change(3);
+        CountSink<int> sink;
+        change >> sink;
+        bench("ChangeFlow<int>(3)", [&](uint32_t i) { change.onNext(sample(i)); });
+    }
+    {
+        ToMqtt<int> toMqtt("remote/potLeft");
+        CountSink<MqttMessage> sink;
+        toMqtt >> sink;
+        bench("ToMqtt<int>", [&](uint32_t i) { toMqtt.onNext(i); });
+    }
+    {
+        ToMqtt<float> toMqtt("motor/rpmMeasured");
+        CountSink<MqttMessage> sink;
+        toMqtt >> sink;
+        bench("ToMqtt<float>", [&](uint32_t i) { toMqtt.onNext(i * 0.5f); });
+    }
+    {
+        FromMqtt<int> fromMqtt("motor/rpmTarget");
+        CountSink<int> sink;
+        fromMqtt >> sink;
+        MqttMessage msg = {"motor/rpmTarget", "1234"};
+        bench("FromMqtt<int>", [&](uint32_t) { fromMqtt.onNext(msg); });
+    }
+    {
+        AsyncFlow<int> async(20);
+        CountSink<int> sink;
+        async >> sink;
+        bench("AsyncFlow<int> onNext+request", [&](uint32_t i) {
+            async.onNext(i);
+            async.request();
+        });
+    }
+    {
+        AsyncFlow<int> async(EMIT_BATCH);
+        CountSink<int> sink;
+        async >> sink;
+        bench("AsyncFlow<int> burst drain per value", [&](uint32_t i) {
+            async.onNext(i);
+            if(i % EMIT_BATCH == EMIT_BATCH - 1) async.request();
+        });
+    }
+    {
+        AsyncRingFlow<int, 8> async;
+        CountSink<int> sink;
+        async >> sink;
+        bench("AsyncRingFlow<int,8> onNext+request", [&](uint32_t i) {
+            async.onNext(i);
+            async.request();
+        });
+    }
+    {
+        AsyncFlow<MqttMessage> outgoing(20);
+        CountSink<MqttMessage> sink;
+        outgoing >> sink;
+        Median<int, 5> median;
+        Throttle<int> throttle(100);
+        ChangeFlow<int> change(3);
+        ToMqtt<int> toMqtt("remote/potLeft");
+        median >> throttle >> change >> toMqtt >> outgoing;
+        bench("pot : Median >> Throttle >> ChangeFlow >> toTopic", [&](uint32_t i) {
+            median.onNext(sample(i));
+            outgoing.request();
+        });
+    }
+    {
+        AsyncFlow<MqttMessage> outgoing(20);
+        CountSink<MqttMessage> sink;
+        outgoing >> sink;
+        Median<int, 5> median;
+        ToMqtt<int> toMqtt("remote/potLeft");
+        median >> toMqtt >> outgoing;
+        bench("unthrottled : Median >> toTopic", [&](uint32_t i) {
+            median.onNext(sample(i));
+            outgoing.request();
+        });
+    }
+    {
+        AsyncFlow<MqttMessage> outgoing(20);
+        CountSink<MqttMessage> sink;
+        outgoing >> sink;
+        ToMqtt<int> toMqtt("drive/motor/rpmMeasured/filtered"); // no small string
+        toMqtt >> outgoing;
+        bench("toTopic long topic >> AsyncFlow", [&](uint32_t i) {
+            toMqtt.onNext(i);
+            outgoing.request();
+        });
+    }
+    {
+        AsyncFlow<MqttMessage> incoming(20);
+        FromMqtt<int> fromMqtt("motor/rpmTarget");
+        CountSink<int> sink;
+        incoming >> fromMqtt >> sink;
+        const char topic[] = "src/remote/motor/rpmTarget"; // as in the esp-mqtt event
+        bench("incoming MqttMessage >> AsyncFlow >> fromTopic", [&](uint32_t) {
+            incoming.emit(MqttMessage(topic + 11, sizeof(topic) - 12, "1234", 4));
+            incoming.request();
+        });
+        printf("MqttBuffer pool high water %u fallbacks %u\n", MqttBuffer::highWater(),
+               MqttBuffer::fallbacks());
+    }
+    {
+        // drive node : 20+ subscribed topics
+        static const char* topics[] = {"motor/KI", "motor/KP", "motor/KD", "motor/current",
+                                       "motor/rpmTarget", "motor/running", "servo/KI", "servo/KP",
+                                       "servo/KD", "servo/current", "servo/angleTarget",
+                                       "servo/running", "remote/ledLeft", "remote/ledRight",
+                                       "wifi/prefix", "system/dummy", "system/traceDump",
+                                       "motor/KF", "servo/KF", "remote/potLeft"};
+        const size_t count = sizeof(topics) / sizeof(topics[0]);
+        std::deque<FromMqtt<int>> flows;
+        for(size_t i = 0; i < count; i++) flows.emplace_back(topics[i]);
+        CountSink<int> sink;
+        ValueFlow<MqttMessage> incoming;
+        MqttRouter router;
+        for(size_t i = 0; i < count; i++) {
+            flows[i] >> sink;
+            incoming >> flows[i];
+            router.add(topics[i], flows[i]);
+        }
+        MqttMessage msg("servo/angleTarget", "45");
+        bench("20 topics : incoming >> every fromTopic", [&](uint32_t) { incoming.emit(msg); });
+        bench("20 topics : MqttRouter", [&](uint32_t) { router.onNext(msg); });
+    }
+    {
+        Pipeline<MedianStage<int32_t, 5>, ThrottleStage<int32_t>> pipeline(
+            MedianStage<int32_t, 5>(), ThrottleStage<int32_t>(100));
+        CountSink<int32_t> sink;
+        pipeline >> sink;
+        bench("Pipeline<MedianStage,ThrottleStage>", [&](uint32_t i) { pipeline.onNext(sample(i)); });
+    }
+    return 0;
+}
@@ -0,0 +1,529 @@
+//______________________________________________________________________
+//
+// Host tests of the stream and MQTT codec logic that has no ESP-IDF
+// dependency.
+//
+//    make -C bench test
+//______________________________________________________________________
+#include <Streams.h>
+#include <MqttCodec.h>
+#include <Pipeline.h>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <unistd.h>
+
+static uint32_t checks = 0;
+static uint32_t failures = 0;
+
+#define CHECK(x)                                                              \
+    do {                                                                      \
+        checks++;                                                             \
+        if(!(x)) {                                                            \
+            failures++;                                                       \
+            printf("%s:%d CHECK(%s) failed\n", __FILE__, __LINE__, #x);       \
+        }                                                                     \
+    } while(0)
+//______________________________________________________________________
+//
+static void testDemandCycle()
+{
+    ValueFlow<uint32_t> dummy;
+    MqttFlow<uint32_t> flow("system/dummy");
+    dummy == flow; // subscribes both ways
+    CHECK(dummy.hasDemand());
+    CHECK(dummy.downstreamDemand() == UINT32_MAX);
+
+    AsyncFlow<uint32_t> async(2);
+    async.backpressure(true);
+    ValueFlow<uint32_t> a, b;
+    a == b;
+    b >> async;
+    CHECK(a.downstreamDemand() == 2);
+    async.onNext(1);
+    async.onNext(2);
+    CHECK(!a.hasDemand());
+    async.onNext(3);
+    CHECK(async.overflows() == 1);
+
+    AsyncRingFlow<int, 4> ring; // backpressure is opt-in for every async flow
+    ValueFlow<int> toRing;
+    toRing >> ring;
+    for(int i = 0; i < 4; i++) ring.onNext(i);
+    CHECK(toRing.downstreamDemand() == UINT32_MAX);
+    ring.backpressure(true);
+    CHECK(!toRing.hasDemand());
+
+    AsyncFlow<MqttMessage> outgoing(1); // full, toTopic and topic both see it
+    outgoing.backpressure(true);
+    ValueFlow<float> pwm, KI;
+    ToMqtt<float> toMqtt("motor/pwm");
+    MqttFlow<float> mqttFlow("motor/KI");
+    pwm >> toMqtt >> outgoing;
+    KI == mqttFlow;
+    mqttFlow.mqttOut >> outgoing;
+    CHECK(KI.hasDemand());
+    outgoing.onNext(MqttMessage("a", "1"));
+    CHECK(!pwm.hasDemand());
+    CHECK(!KI.hasDemand());
+
+    std::vector<std::thread> pollers; // demand of one cycle on several threads
+    std::atomic<uint32_t> wrong(0);
+    for(int i = 0; i < 4; i++)
+        pollers.emplace_back([&]() {
+            for(int j = 0; j < 10000; j++)
+                if(a.downstreamDemand() != 0) wrong++; // async is full
+        });
+    for(std::thread& t : pollers) t.join();
+    CHECK(wrong == 0);
+}
+//______________________________________________________________________
+//
+static void testThreadQueue()
+{
+    Thread thread(2); // not started, work stays queued
+    AsyncFlow<int> a(4), b(4), c(4);
+    a.observeOn(thread);
+    b.observeOn(thread);
+    c.observeOn(thread);
+    a.onNext(1);
+    b.onNext(1);
+    c.onNext(1); // lane full
+    a.onNext(2); // already queued, not counted
+    ThreadStats stats = thread.stats();
+    CHECK(stats.overflows == 1);
+    CHECK(stats.queueHighWater == 2);
+}
+
+static void testThreadJoin()
+{
+    std::atomic<uint32_t> received(0), fired(0);
+    LambdaSink<int> sink([&](const int& v) { received += v; });
+    LambdaSink<TimerMsg> tick([&](const TimerMsg&) { fired++; });
+    AsyncFlow<int> work(10);
+    TimerSource timer(1, 5, true);
+    work >> sink;
+    timer >> tick;
+    Thread thread;
+    Thread pooled;
+    Executor executor; // destroyed before the thread it runs
+    work.observeOn(pooled);
+    pooled.addTimer(&timer);
+    executor.add(pooled);
+    thread.start();
+    executor.start(0, 0);
+    for(int i = 1; i <= 4; i++) work.onNext(i); // queued from this thread
+    usleep(50000);
+    CHECK(received == 10); // a worker ran the pooled thread's queue
+    CHECK(fired >= 5);     // and its timer, every 5 msec
+    // destructors stop and join, no std::terminate
+}
+
+static void testThreadBusy()
+{
+    TimerSource timer(1, 1, true);
+    LambdaSink<TimerMsg> spin([](const TimerMsg&) { // 5 msec of work per msec
+        uint64_t end = Sys::micros() + 5000;
+        while(Sys::micros() < end) {}
+    });
+    Thread thread; // joined before the timer goes
+    timer >> spin;
+    thread.addTimer(&timer);
+    thread.stats();
+    thread.start();
+    usleep(100000);
+    ThreadStats stats = thread.stats();
+    CHECK(stats.busyUs > 80000); // saturated, never idle
+    CHECK(stats.dispatched > 10); // timer handlers count
+    CHECK(stats.longestRequestUs >= 5000);
+}
+
+static void testTimerWakeup()
+{
+    Thread thread;
+    std::deque<TimerSource> timers;
+    uint64_t now = Sys::millis();
+    for(uint32_t i = 0; i < 50; i++) {
+        timers.emplace_back(i, 100 + (i * 37) % 500, true);
+        timers.back().slack((i * 53) % 300);
+        thread.addTimer(&timers.back());
+    }
+    uint64_t expected = UINT64_MAX;
+    for(TimerSource& timer : timers)
+        if(timer.latestTime() < expected) expected = timer.latestTime();
+    CHECK(thread.fireExpiredTimers(now) == expected);
+}
+
+static void testPipelineTimers()
+{
+    Pipeline<TimeoutStage<int>, TimeoutStage<int>> pipeline(TimeoutStage<int>(100, 1),
+                                                            TimeoutStage<int>(200, 2));
+    std::vector<int> out;
+    LambdaSink<int> sink([&](const int& v) { out.push_back(v); });
+    pipeline >> sink;
+    pipeline.onNext(TimerMsg{2}); // second stage only
+    CHECK(out.size() == 1 && out[0] == 2);
+    out.clear();
+    pipeline.onNext(TimerMsg{1}); // first stage, passed through the second
+    CHECK(out.size() == 1 && out[0] == 1);
+}
+
+static void testRingBufferRelease()
+{
+    RingBuffer<MqttMessage>::Slot slots[4];
+    RingBuffer<MqttMessage> ring(slots, 4);
+    uint32_t available = MqttBuffer::available();
+    ring.push(MqttMessage("a/b", "1"));
+    {
+        MqttMessage m;
+        CHECK(ring.pop(m));
+        CHECK(m.message == "1");
+    }
+    CHECK(MqttBuffer::available() == available); // slot doesn't hold the buffer
+}
+
+static void testValueFlowOrder()
+{
+    ValueFlow<std::string> flow("old");
+    std::string seen;
+    LambdaSink<std::string> sink([&](const std::string&) { seen = flow(); });
+    flow >> sink;
+    std::string value("new");
+    flow.onNext(value);
+    CHECK(seen == "old");
+    flow = "newer"; // move path, same order
+    CHECK(seen == "new");
+    CHECK(flow() == "newer");
+}
+
+static void testJsonScalar()
+{
+    int32_t i;
+    uint64_t u;
+    double d;
+    CHECK(JsonScalar<int32_t>::parse("-5", i) && i == -5);
+    CHECK(JsonScalar<int32_t>::parse("0 \n", i) && i == 0);
+    CHECK(!JsonScalar<int32_t>::parse("+5", i));
+    CHECK(JsonScalar<int32_t>::parse(" 5", i) && i == 5); // JSON whitespace
+    CHECK(!JsonScalar<int32_t>::parse("05", i));
+    CHECK(!JsonScalar<int32_t>::parse("1.0", i)); // a float for ArduinoJson
+    CHECK(!JsonScalar<int32_t>::parse("2147483648", i));
+    CHECK(JsonScalar<uint64_t>::parse("18446744073709551615", u) && u == UINT64_MAX);
+    CHECK(JsonScalar<int32_t>::parse("\t\r\n-1", i) && i == -1);
+    CHECK(!JsonScalar<uint64_t>::parse("\t-1", u)); // sign after the whitespace
+    CHECK(!JsonScalar<uint64_t>::parse("-1", u));
+    CHECK(!JsonScalar<uint64_t>::parse("18446744073709551616", u));
+    CHECK(JsonScalar<double>::parse("-1.5e-3", d) && d == -1.5e-3);
+    CHECK(JsonScalar<double>::parse("0.5", d) && d == 0.5);
+    CHECK(!JsonScalar<double>::parse(".5", d));
+    CHECK(!JsonScalar<double>::parse("1.", d));
+    CHECK(!JsonScalar<double>::parse("+5", d));
+    CHECK(!JsonScalar<double>::parse("1e", d));
+    CHECK(!JsonScalar<double>::parse("nan", d));
+    CHECK(JsonScalar<double>::parse("\n0.5", d) && d == 0.5);
+    bool b;
+    CHECK(JsonScalar<bool>::parse("\ttrue\n", b) && b);
+    CHECK(!JsonScalar<bool>::parse("True", b));
+}
+
+static void testMailbox()
+{
+    RingBuffer<int>::Slot slots[5];
+    RingBuffer<int> ring(slots, 5); // only 4 slots used
+    CHECK(ring.capacity() == 4);
+
+    std::vector<int> received;
+    LambdaSink<int> sink([&](const int& v) { received.push_back(v); });
+    ValueFlow<int> flow;
+    {
+        Thread thread; // joined here, received is read after
+        flow.observeOn(thread).mailbox(5);
+        flow >> sink;
+        thread.start();
+        for(int i = 0; i < 5; i++) flow.onNext(i); // from another thread
+        usleep(20000);
+    }
+    CHECK(received.size() == 5);
+    bool ordered = true;
+    for(size_t i = 0; i < received.size(); i++) ordered &= received[i] == (int)i;
+    CHECK(ordered);
+}
+
+static void testMqttPool()
+{
+    AsyncFlow<MqttMessage> incoming(MQTT_QUEUE_DEPTH), outgoing(MQTT_QUEUE_DEPTH);
+    uint32_t fallbacks = MqttBuffer::fallbacks();
+    for(uint32_t i = 0; i < MQTT_QUEUE_DEPTH + 5; i++) { // both full, oldest dropped
+        incoming.onNext(MqttMessage("dst/drive/motor/KI", "1.5"));
+        outgoing.onNext(MqttMessage("motor/rpmMeasured", "1234"));
+    }
+    MqttMessage building("system/alive", "true"); // still pooled
+    CHECK(MqttBuffer::fallbacks() == fallbacks);
+    CHECK(MqttBuffer::available() >= 7);
+}
+
+static void testTimerRestart()
+{
+    TimerSource timeout(1, 20, true);
+    std::atomic<uint32_t> fired(0);
+    LambdaSink<TimerMsg> sink([&](const TimerMsg&) { fired++; });
+    timeout >> sink;
+    {
+        Thread thread;
+        thread.addTimer(&timeout);
+        thread.start();
+        uint64_t end = Sys::millis() + 100;
+        while(Sys::millis() < end) { // restarted from another thread, as by a capture ISR
+            timeout.start();
+            usleep(1000);
+        }
+        CHECK(fired == 0);
+        usleep(50000);
+        CHECK(fired > 0);
+    }
+}
+
+// stalls a 10 msec timer for 5 periods, returns the fires of the first
+// passes after the stall
+static uint32_t stallTimer(TimerSource& timer, uint64_t& firstExpiry)
+{
+    uint32_t fired = 0;
+    LambdaSink<TimerMsg> sink([&](const TimerMsg&) { fired++; });
+    timer >> sink;
+    firstExpiry = timer.expireTime();
+    usleep(55000);
+    for(int i = 0; i < 20; i++) timer.request();
+    return fired;
+}
+
+static void testTimerOverrun()
+{
+    uint64_t first;
+    TimerSource skip(1, 10, true);
+    skip.overrun(OVERRUN_SKIP);
+    CHECK(stallTimer(skip, first) == 1); // no burst after a stall
+    CHECK((skip.expireTime() - first) % 10 == 0); // on the period grid
+    CHECK(skip.expireTime() > Sys::millis() - 10 && skip.expireTime() <= Sys::millis() + 10);
+    CHECK(skip.overruns() == 1);
+
+    TimerSource catchup(1, 10, true); // OVERRUN_CATCHUP by default
+    CHECK(stallTimer(catchup, first) >= 5); // one per missed period
+    CHECK((catchup.expireTime() - first) % 10 == 0);
+    CHECK(catchup.overruns() >= 4);
+
+    TimerSource coalesce(1, 10, true);
+    coalesce.overrun(OVERRUN_COALESCE);
+    CHECK(stallTimer(coalesce, first) == 1);
+    uint64_t now = Sys::millis();
+    CHECK(coalesce.expireTime() > now && coalesce.expireTime() <= now + 10); // from now
+    CHECK(coalesce.overruns() == 1);
+}
+
+// logs its name when run, spins usec, requeues itself when busy
+class Work : public Requestable
+{
+public:
+    char name;
+    std::string& log;
+    Thread& thread;
+    uint32_t usec = 0;
+    bool busy = false;
+    Work(char n, std::string& l, Thread& t) : name(n), log(l), thread(t) {}
+    void request()
+    {
+        log += name;
+        uint64_t end = Sys::micros() + usec;
+        while(Sys::micros() < end) {}
+        if(busy) thread.awakeRequestable(this);
+    }
+};
+
+static void testThreadBudget()
+{
+    std::string log;
+    Thread thread; // not started, stepped here
+    thread.budget(1000);
+    Work a('a', log, thread), b('b', log, thread), c('c', log, thread);
+    a.usec = b.usec = c.usec = 2000; // each one over the budget
+    a.busy = true; // always has more, must not starve the others
+    thread.awakeRequestable(&a);
+    thread.awakeRequestable(&b);
+    thread.awakeRequestable(&c);
+    bool more;
+    for(int i = 0; i < 5; i++) {
+        thread.step(more);
+        CHECK(more); // returned for the budget, one requestable per step
+    }
+    CHECK(log == "abcaa"); // b and c ran before a came back
+}
+
+static void testThreadLanes()
+{
+    std::string log;
+    Thread thread(2); // 2 entries per lane
+    Work w1('1', log, thread), w2('2', log, thread), w3('3', log, thread), w4('4', log, thread);
+    w3.priority(PRIO_HIGH);
+    CHECK(thread.awakeRequestable(&w1) == 0);
+    CHECK(thread.awakeRequestable(&w2) == 0);
+    CHECK(thread.awakeRequestable(&w4) != 0); // normal lane full
+    CHECK(thread.awakeRequestable(&w3) == 0); // high lane has its own room
+    ThreadStats stats = thread.stats();
+    CHECK(stats.overflows == 1);
+    CHECK(stats.queueHighWater == 2);
+    bool more;
+    thread.step(more);
+    CHECK(log == "312"); // queued last, run first
+}
+
+static void testInlineFunction()
+{
+    std::shared_ptr<int> shared(new int(1)); // counts the copies held
+    InlineFunction<int(int)> f([shared](int x) { return *shared + x; });
+    CHECK(shared.use_count() == 2);
+    {
+        InlineFunction<int(int)> copy(f);
+        InlineFunction<int(int)> moved(std::move(copy));
+        CHECK(shared.use_count() == 4);
+        CHECK(moved(2) == 3);
+        CHECK(f(1) == 2);
+        copy = InlineFunction<int(int)>();
+        CHECK(shared.use_count() == 3);
+        CHECK(!copy);
+    }
+    CHECK(shared.use_count() == 2); // every copy destroyed once
+
+    void* p[4] = {&p[0], &p[1], &p[2], &p[3]};
+    void *a = p[0], *b = p[1], *c = p[2], *d = p[3];
+    InlineFunction<bool()> full([a, b, c, d]() { return a != b && c != d; }); // fills SIZE
+    CHECK(full());
+    CHECK(sizeof(full) <= INLINE_FUNCTION_SIZE + 2 * sizeof(void*) + alignof(std::max_align_t));
+}
+
+static void testObserverSpill()
+{
+    const uint32_t count = SOURCE_INLINE_OBSERVERS + 3; // past the inline slots, grows twice
+    uint32_t received[count] = {0};
+    std::deque<LambdaSink<int>> sinks;
+    ValueFlow<int> flow;
+    for(uint32_t i = 0; i < count; i++) {
+        uint32_t* r = &received[i];
+        sinks.emplace_back([r](const int& v) { *r += v; });
+        flow >> sinks.back();
+    }
+    flow.onNext(1);
+    ValueFlow<int> copy(flow); // copies the spilled list
+    copy.onNext(2);
+    bool all = true;
+    for(uint32_t i = 0; i < count; i++) all &= received[i] == 3;
+    CHECK(all);
+}
+//______________________________________________________________________
+//
+static void testMqttWildcards()
+{
+    CHECK(mqttMatch("a/#", MqttMessage("a", "").topic)); // parent level too
+    CHECK(mqttMatch("a/#", MqttMessage("a/b/c", "").topic));
+    CHECK(!mqttMatch("a/#", MqttMessage("ab", "").topic));
+    CHECK(mqttMatch("+/b", MqttMessage("a/b", "").topic));
+    CHECK(!mqttMatch("+/b", MqttMessage("a/b/c", "").topic));
+    CHECK(!mqttMatch("+/b", MqttMessage("b", "").topic));
+    CHECK(mqttMatch("#", MqttMessage("a/b", "").topic));
+
+    MqttRouter router;
+    uint32_t hashes = 0, pluses = 0, all = 0, exact = 0;
+    LambdaSink<MqttMessage> s1([&](const MqttMessage&) { hashes++; });
+    LambdaSink<MqttMessage> s2([&](const MqttMessage&) { pluses++; });
+    LambdaSink<MqttMessage> s3([&](const MqttMessage&) { all++; });
+    LambdaSink<MqttMessage> s4([&](const MqttMessage&) { exact++; });
+    router.add("a/#", s1);
+    router.add("+/b", s2);
+    router.add("#", s3);
+    router.add("a/b", s4);
+    router.onNext(MqttMessage("a", "1"));
+    CHECK(hashes == 1 && pluses == 0 && all == 1 && exact == 0);
+    router.onNext(MqttMessage("a/b", "1"));
+    CHECK(hashes == 2 && pluses == 1 && all == 2 && exact == 1);
+    router.onNext(MqttMessage("x/b", "1"));
+    CHECK(hashes == 2 && pluses == 2 && all == 3 && exact == 1);
+    CHECK(router.unrouted() == 0);
+}
+
+static void testMqttSubscriptions()
+{
+    MqttRouter router;
+    LambdaSink<MqttMessage> sink([](const MqttMessage&) {});
+    router.add("a/b", sink);
+    router.add("a/+", sink);
+    router.add("a/#", sink);
+    router.add("c/d", sink);
+    router.add("c/d", sink);
+    router.add("+/e", sink);
+    std::vector<std::string> filters = router.subscriptions();
+    CHECK(filters.size() == 3 && filters[0] == "a/#" && filters[1] == "c/d" && filters[2] == "+/e");
+    router.add("#", sink);
+    filters = router.subscriptions();
+    CHECK(filters.size() == 1 && filters[0] == "#");
+}
+
+static void testMqttTopicCollision()
+{
+    MqttTopic t1("t/122789"), t2("t/339192"), t3("system/heap");
+    CHECK(t1.id == t2.id); // FNV-1a collision
+    MqttTopics topics;
+    topics.add(t1);
+    topics.add(t3);
+    topics.prefix("src/host/");
+    CHECK(topics.prefixed(MqttMessage(t1, "1", 1)) != 0);
+    topics.add(t2); // neither name is trusted with the id anymore
+    CHECK(topics.prefixed(MqttMessage(t1, "1", 1)) == 0);
+    CHECK(topics.prefixed(MqttMessage(t2, "1", 1)) == 0);
+    const std::string* name = topics.prefixed(MqttMessage(t3, "1", 1));
+    CHECK(name && *name == "src/host/system/heap");
+}
+
+static void testRingBufferWrap()
+{
+    RingBuffer<uint32_t>::Slot slots[4];
+    RingBuffer<uint32_t> ring(slots, 4);
+    uint32_t next = 0, expected = 0, value;
+    bool ordered = true;
+    for(uint32_t round = 0; round < 10; round++) { // wraps the 4 slots 7 times
+        for(uint32_t i = 0; i < 3; i++) ring.push(next++);
+        while(ring.pop(value)) ordered &= value == expected++;
+    }
+    CHECK(ordered && expected == 30);
+    for(uint32_t i = 0; i < 5; i++) ring.push(i);
+    CHECK(ring.size() == 4);
+    CHECK(ring.overflows() == 1);
+    CHECK(ring.pop(value) && value == 0);
+}
+//______________________________________________________________________
+//
+int main()
+{
+    testDemandCycle();
+    testThreadQueue();
+    testThreadJoin();
+    testThreadBusy();
+    testTimerWakeup();
+    testPipelineTimers();
+    testRingBufferRelease();
+    testValueFlowOrder();
+    testJsonScalar();
+    testMqttWildcards();
+    testMqttSubscriptions();
+    testMqttTopicCollision();
+    testRingBufferWrap();
+    testMailbox();
+    testMqttPool();
+    testTimerRestart();
+    testTimerOverrun();
+    testThreadBudget();
+    testThreadLanes();
+    testInlineFunction();
+    testObserverSpill();
+    printf("%u checks, %u failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
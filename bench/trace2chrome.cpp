@@ -0,0 +1,46 @@
+//______________________________________________________________________
+//
+// Converts the TRACE lines of a console log ( see main/Trace.h ) into
+// Chrome trace_event JSON, open the result in chrome://tracing or
+// ui.perfetto.dev
+//
+//    ./trace2chrome < USB0_minicom.log > trace.json
+//______________________________________________________________________
+#include <Trace.h>
+#include <cstdio>
+#include <cstring>
+#include <set>
+
+static const char* kindNames[] = {"request", "onNext", "timer", "isr"};
+
+int main(int argc, char** argv)
+{
+    char line[256];
+    std::set<uint32_t> tasks;
+    uint64_t offset = 0;  // 32 bit usec clock unwrapped
+    uint32_t lastTime = 0;
+    bool first = true;
+    printf("{\"traceEvents\":[\n");
+    while(fgets(line, sizeof(line), stdin)) {
+        const char* start = strstr(line, "TRACE ");
+        uint32_t time, object, task, kind, phase;
+        if(start == 0 ||
+           sscanf(start, "TRACE %8x %8x %8x %x %x", &time, &object, &task, &kind, &phase) != 5)
+            continue; // other log line or TRACE BEGIN/END
+        if(kind > TRACE_ISR) continue;
+        if(!first && time < lastTime && lastTime - time > 0x80000000u) offset += 0x100000000ull;
+        lastTime = time;
+        tasks.insert(task);
+        printf("%s{\"name\":\"%s %08X\",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%llu,\"pid\":1,\"tid\":%u}",
+               first ? "" : ",\n", kindNames[kind], object, kindNames[kind],
+               phase == TRACE_BEGIN ? "B" : "E", (unsigned long long)(offset + time), task);
+        first = false;
+    }
+    for(uint32_t task : tasks) {
+        printf("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s%08X\"}}",
+               first ? "" : ",\n", task, task ? "task " : "ISR ", task);
+        first = false;
+    }
+    printf("\n]}\n");
+    return 0;
+}
@@ -2,19 +2,12 @@
 
 Neo6m::Neo6m(Connector* connector)
 	: _connector(connector),_uart(connector->getUART()) {
+	_line.reserve(100);
 }
 
 Neo6m::~Neo6m() {
 }
 
-std::string stringify(std::string in) {
-	std::string out="\"";
-	out+=in;
-	out+="\"";
-	return out;
-}
-
-
 void Neo6m::init() {
 	_uart.setClock(9600);
 	_uart.onRxd(onRxd,this);
@@ -36,9 +29,17 @@ void Neo6m::handleRxd() {
 		char ch = _uart.read();
 		if ( ch=='\n' || ch=='\r') {
 			if ( _line.size()>8 ) { // cannot use msgBuilder as out of thread
-				std::string topic="neo6m/";
-				topic+=_line.substr(1,5);
-				emit({topic,stringify(_line.substr(7))});
+				char topic[] = "neo6m/xxxxx";
+				memcpy(topic + 6, _line.data() + 1, 5);
+				size_t length = _line.size() - 7 + 2; // sentence as JSON string
+				MqttMessage msg(topic, sizeof(topic) - 1, 0, length);
+				char* payload = msg.payload();
+				if ( payload ) {
+					payload[0] = '"';
+					memcpy(payload + 1, _line.data() + 7, length - 2);
+					payload[length - 1] = '"';
+					emit(std::move(msg));
+				}
 			}
 			_line.clear();
 		} else {
@@ -14,6 +14,8 @@ MotorSpeed::MotorSpeed(uint32_t pinLeftIS, uint32_t pinRightIS,
 
 {
     //_rpmMeasuredFilter = new AverageFilter<float>();
+    _controlTimer.deadline(CONTROL_INTERVAL_MS / 5); // PID before reporting
+    _controlTimer.overrun(OVERRUN_SKIP); // no burst of PID steps after a stall
     rpmTarget = 0;
     _bts7960.setPwmUnit(0);
     integral.emitOnChange(false);
@@ -21,7 +23,7 @@ MotorSpeed::MotorSpeed(uint32_t pinLeftIS, uint32_t pinRightIS,
     proportional.emitOnChange(false);
     pwm.emitOnChange(false);
 
-    _reportTimer >> *new LambdaSink<TimerMsg>([&](TimerMsg tm) {
+    _reportTimer >> topology.make<LambdaSink<TimerMsg>>([&](TimerMsg tm) {
         integral.request();
         derivative.request();
         proportional.request();
@@ -43,11 +45,11 @@ MotorSpeed::MotorSpeed(uint32_t pinLeftIS, uint32_t pinRightIS,
         	}*/
     });
 
-    _pulseTimer >> *new LambdaSink<TimerMsg>([&](TimerMsg tm) {
+    _pulseTimer >> topology.make<LambdaSink<TimerMsg>>([&](TimerMsg tm) {
         pulse();
     });
 
-    auto pidCalc = new LambdaSink<int>([&](int rpm) {
+    auto& pidCalc = topology.make<LambdaSink<int>>([&](int rpm) {
         if ( isRunning() ) {
             static float newOutput;
             error = rpmTarget() - rpm;
@@ -64,9 +66,9 @@ MotorSpeed::MotorSpeed(uint32_t pinLeftIS, uint32_t pinRightIS,
         }
     });
 
-    rpmMeasured >> *pidCalc ;
+    rpmMeasured >> pidCalc ;
     rpmMeasured.emitOnChange(false);
-    _controlTimer >> *new LambdaSink<TimerMsg>([&](TimerMsg tick) {
+    _controlTimer >> topology.make<LambdaSink<TimerMsg>>([&](TimerMsg tick) {
         rpmMeasured.request();
     });
 }
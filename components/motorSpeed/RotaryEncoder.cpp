@@ -28,6 +28,7 @@ static mcpwm_dev_t* MCPWM[2] = {&MCPWM0, &MCPWM1};
 
 void IRAM_ATTR RotaryEncoder::isrHandler(void* pv) { // ATTENTION !!! no float calculations in ISR
 	RotaryEncoder* re = (RotaryEncoder*)pv;
+	TRACE_ENTER(TRACE_ISR, pv);
 	uint32_t mcpwm_intr_status;
 	// check encoder B when encoder A has isr,
 	// indicates phase or rotation direction
@@ -41,17 +42,21 @@ void IRAM_ATTR RotaryEncoder::isrHandler(void* pv) { // ATTENTION !!! no float c
 	if(mcpwm_intr_status & CAP0_INT_EN) {
 		uint32_t capt = mcpwm_capture_signal_get_value(re->_mcpwm_num,MCPWM_SELECT_CAP0);
 		// get capture signal counter value
-		re->_rawCapture.onNext((capt-re->_prevCapture)* re->_direction);
+		re->_capturePipeline.onNext((capt-re->_prevCapture)* re->_direction);
 		re->_prevCapture = capt;
 	}
 	MCPWM[re->_mcpwm_num]->int_clr.val = mcpwm_intr_status;
+	TRACE_EXIT(TRACE_ISR, pv);
 }
 
 RotaryEncoder::RotaryEncoder(uint32_t pinTachoA, uint32_t pinTachoB)
 	: _pinTachoA(pinTachoA)
 	, _dInTachoB(DigitalIn::create(pinTachoB))
 	,_captures(10)
-	,rpmMeasured(5),
+	,_capturePipeline(CaptureMedian(),				// get median , reduce noise
+	                  CaptureToRpm(this),				// convert to RPM
+	                  ThrottleStage<int32_t>(100),		// max 10 samples per sec
+	                  TimeoutStage<int32_t>(200, 0)),	// non received eq 0
 	  isrCounter([&]() {
 	return _isrCounter;
 }) {         // if no rpm measurement, suppose 0 as no capture
@@ -64,23 +69,16 @@ RotaryEncoder::RotaryEncoder(uint32_t pinTachoA, uint32_t pinTachoB)
 	_mcpwm_num = MCPWM_UNIT_0;
 	_timer_num = MCPWM_TIMER_0;
 
-	auto median = new Median<int32_t,5>();
-	auto captureToRpm = new LambdaFlow<int32_t, int32_t>([&](const int32_t& delta) {
-		{
-			int32_t rpm = deltaToRpm(delta);
-			return rpm;
-		}
+	// emit async in another thread, the timeout emits from the motor thread
+	_rpmOut.handler([&](const int32_t& v) {
+		if(xPortInIsrContext())
+			rpmMeasured.onNextFromIsr(v);
+		else
+			rpmMeasured.onNext(v);
 	});
-	auto throttle = new Throttle<int32_t>(100);
-	_timeoutFlow =  new TimeoutFlow<int32_t>(200,0);
-
-	_rawCapture >> *median 				// get median , reduce noise
-	            >> *captureToRpm		// convert to RPM
-	            >> *throttle			// max 10 samples per sec
-	            >> *_timeoutFlow			// non received eq 0
-	            >> rpmMeasured.fromIsr;	// emit async in another thread
+	_capturePipeline >> _rpmOut;
 
-	rpmMeasured >> *new LambdaSink<int32_t>([&](const int32_t& v) {
+	rpmMeasured >> topology.make<LambdaSink<int32_t>>([&](const int32_t& v) {
 		{
 			INFO(" value %d ",v);
 		}
@@ -89,8 +87,8 @@ RotaryEncoder::RotaryEncoder(uint32_t pinTachoA, uint32_t pinTachoB)
 
 
 void RotaryEncoder::observeOn(Thread& t) {
-	_timeoutFlow->timer.observeOn(t);
-	rpmMeasured.observeOn(t);
+	_capturePipeline.timersOn(t);
+	rpmMeasured.observeOn(t, PRIO_HIGH); // control path ahead of telemetry
 }
 
 RotaryEncoder::~RotaryEncoder() {}
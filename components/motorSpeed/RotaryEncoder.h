@@ -4,6 +4,7 @@
 #include <Hardware.h>
 #include <Log.h>
 #include <Streams.h>
+#include <Pipeline.h>
 #include <coroutine.h>
 #include "driver/mcpwm.h"
 #include "driver/pcnt.h"
@@ -48,19 +49,28 @@ class RotaryEncoder {
 		mcpwm_timer_t _timer_num;
 		int32_t _samples[MAX_SAMPLES];
 		uint32_t _indexSample = 0;
-		ValueFlow<int32_t> _rawCapture;
-		TimeoutFlow<int32_t> *_timeoutFlow;
 		ValueFlow<int32_t> _captures;
 
 	public:
-		AsyncFlow<int32_t> rpmMeasured ;
+		int32_t deltaToRpm(const int32_t delta);
+
+	private:
+		typedef MedianStage<int32_t, 5> CaptureMedian;
+		typedef MethodStage<RotaryEncoder, int32_t, int32_t,
+		        &RotaryEncoder::deltaToRpm> CaptureToRpm;
+		// fused, called directly from the capture ISR
+		Pipeline<CaptureMedian, CaptureToRpm, ThrottleStage<int32_t>,
+		         TimeoutStage<int32_t>> _capturePipeline;
+		LambdaSink<int32_t> _rpmOut; // ISR captures and the timeout timer
+
+	public:
+		AsyncRingFlow<int32_t, 8> rpmMeasured;
 		LambdaSource<uint32_t> isrCounter;
 
 		RotaryEncoder(uint32_t pinTachoA, uint32_t pinTachoB);
 		~RotaryEncoder();
 		void init();
 		static void isrHandler(void*);
-		int32_t deltaToRpm(const int32_t delta);
 
 		void setPwmUnit(uint32_t);
 		void observeOn(Thread& t);
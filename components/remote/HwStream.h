@@ -58,10 +58,11 @@ class Button : public Source<bool>
         : _dIn(DigitalIn::create(pin))
     {
     }
+    // gpio ISR, the level goes through the mailbox to the observer thread
     static void onChange(void* pv)
     {
 	Button* me = (Button*)pv;
-	me->request();
+	me->emitFromIsr(me->_dIn.read() == 0);
     }
     void init()
     {
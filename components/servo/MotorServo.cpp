@@ -18,6 +18,8 @@ MotorServo::MotorServo(uint32_t pinPot, uint32_t pinIS,
 	_pulseTimer(1,5000,true),
 	_reportTimer(2,1000,true),
 	_controlTimer(3,CONTROL_INTERVAL_MS,true) {
+	_controlTimer.deadline(CONTROL_INTERVAL_MS / 5); // PID before reporting
+	_controlTimer.overrun(OVERRUN_SKIP); // no burst of PID steps after a stall
 	_bts7960.setPwmUnit(1);
 }
 
@@ -43,7 +45,7 @@ void MotorServo::init() {
 	if ( rc != E_OK ) WARN("Potentiometer initialization failed");
 	if ( _bts7960.initialize() ) WARN("BTS7960 initialization failed");
 
-	_controlTimer >> *new LambdaSink<TimerMsg>([&](TimerMsg tm) {
+	_controlTimer >> topology.make<LambdaSink<TimerMsg>>([&](TimerMsg tm) {
 		if ( isRunning() ) {
 			if ( angleTarget()< ANGLE_MIN) angleTarget=ANGLE_MIN;
 			if ( angleTarget()> ANGLE_MAX) angleTarget=ANGLE_MAX;
@@ -56,7 +58,7 @@ void MotorServo::init() {
 			_bts7960.setOutput(0);
 		}
 	});
-	_pulseTimer >> *new LambdaSink<TimerMsg>([&](TimerMsg tm) {
+	_pulseTimer >> topology.make<LambdaSink<TimerMsg>>([&](TimerMsg tm) {
 
 		static uint32_t pulse=0;
 		static int outputTargets[]= {-30,0,30,0};
@@ -65,7 +67,7 @@ void MotorServo::init() {
 		pulse %= (sizeof(outputTargets)/sizeof(int));
 		_pulseTimer.start();
 	});
-	_reportTimer >> *new LambdaSink<TimerMsg>([&](TimerMsg tm) {
+	_reportTimer >> topology.make<LambdaSink<TimerMsg>>([&](TimerMsg tm) {
 		integral.request();
 		derivative.request();
 		proportional.request();
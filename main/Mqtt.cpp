@@ -22,8 +22,8 @@
 //________________________________________________________________________
 //
 Mqtt::Mqtt()
-    :incoming(20)
-    , outgoing(20)
+    :incoming(MQTT_QUEUE_DEPTH)
+    , outgoing(MQTT_QUEUE_DEPTH)
     , _reportTimer(1000, true, true)
     , keepAliveTimer(TIMER_KEEP_ALIVE,1000,true)
 
@@ -40,6 +40,8 @@ void Mqtt::init()
     string_format(_address, "mqtt://%s:%d", S(MQTT_HOST), MQTT_PORT);
     string_format(_lwt_topic, "system/alive", Sys::hostname());
     string_format(_hostPrefix, "src/%s/", Sys::hostname());
+    _topics.prefix(_hostPrefix);
+    _publishTopic.reserve(64);
     _clientId = Sys::hostname();
     //	esp_log_level_set("*", ESP_LOG_VERBOSE);
     esp_mqtt_client_config_t mqtt_cfg;
@@ -67,8 +69,10 @@ void Mqtt::init()
             if(connected()) esp_mqtt_client_stop(_mqttClient);
         }
     });
+    outgoing.backpressure(true); // full queue holds back polled telemetry
     outgoing >> *this;
     *this >> incoming;
+    incoming >> _router; // delivers to fromTopic and topic flows by topic
     keepAliveTimer >> (Sink<TimerMsg>&)(*this);
 }
 //________________________________________________________________________
@@ -93,9 +97,13 @@ void Mqtt::observeOn(Thread& t)
 void Mqtt::onNext(const MqttMessage& m)
 {
     if(connected()) {
-        std::string topic = _hostPrefix;
-        topic += m.topic;
-        mqttPublish(topic.c_str(), m.message.c_str());
+        const std::string* topic = _topics.prefixed(m);
+        if(topic == 0) { // not a toTopic/topic name
+            _publishTopic.assign(_hostPrefix);
+            _publishTopic.append(m.topic.data(), m.topic.length());
+            topic = &_publishTopic;
+        }
+        mqttPublish(topic->c_str(), m.message.c_str());
     };
 }
 //________________________________________________________________________
@@ -124,12 +132,16 @@ int Mqtt::mqtt_event_handler(esp_mqtt_event_t* event)
         INFO("MQTT_EVENT_CONNECTED to %s", me._address.c_str());
         INFO(" session : %d %d ", event->session_present, event->msg_id);
         msg_id = esp_mqtt_client_publish(me._mqttClient, "src/limero/systems", Sys::hostname(), 0, 1, 0);
-        topics = "dst/";
-        topics += Sys::hostname();
-        me.mqttSubscribe(topics.c_str());
-        topics += "/#";
-        me.mqttSubscribe(topics.c_str());
+        // connected first, a route added meanwhile is subscribed twice, not missed
         me.connected=true;
+        // only what fromTopic/topic consume, not dst/<host>/#
+        for(auto& filter : me._router.subscriptions()) {
+            topics = "dst/";
+            topics += Sys::hostname();
+            topics += "/";
+            topics += filter;
+            me.mqttSubscribe(topics.c_str());
+        }
         break;
     }
     case MQTT_EVENT_DISCONNECTED: {
@@ -148,35 +160,25 @@ int Mqtt::mqtt_event_handler(esp_mqtt_event_t* event)
         break;
     case MQTT_EVENT_DATA: {
         DEBUG("MQTT_EVENT_DATA");
-        bool busy = false;
-        if(!busy) {
-            busy = true;
-            static std::string topic;
-            static std::string data;
-            bool ready = true;
-            if(event->data_len != event->total_data_len) {
-                if(event->current_data_offset == 0) {
-                    topic = std::string(event->topic, event->topic_len);
-                    data = std::string(event->data, event->data_len);
-                    ready = false;
-                } else {
-                    data.append(event->data, event->data_len);
-                    if(data.length() != event->total_data_len) {
-                        ready = false;
-                    }
-                }
-            } else {
-                topic = std::string(event->topic, event->topic_len);
-                data = std::string(event->data, event->data_len);
-                topic = topic.substr(me._hostPrefix.length());
-            }
-            if(ready) {
-//               INFO("MQTT RXD %s=%s", topic.c_str(), data.c_str());
-                me.incoming.emit({topic, data});
+        // copied once from the esp-mqtt buffer into a pooled message,
+        // a payload split over several events is assembled in place
+        static MqttMessage pending;
+        if(event->current_data_offset == 0) {
+            const char* topic = event->topic;
+            size_t topicLength = event->topic_len;
+            if(topicLength >= me._hostPrefix.length()) {
+                topic += me._hostPrefix.length();
+                topicLength -= me._hostPrefix.length();
             }
-            busy = false;
-        } else {
-            WARN(" sorry ! MQTT reception busy ");
+            pending = MqttMessage(topic, topicLength, 0, event->total_data_len);
+        }
+        char* payload = pending.payload();
+        if(payload && event->current_data_offset + event->data_len <= pending.message.length()) {
+            memcpy(payload + event->current_data_offset, event->data, event->data_len);
+        }
+        if(event->current_data_offset + event->data_len == event->total_data_len) {
+//               INFO("MQTT RXD %s=%s", pending.topic.c_str(), pending.message.c_str());
+            me.incoming.emit(std::move(pending));
         }
         break;
     }
@@ -200,6 +202,15 @@ void Mqtt::mqttPublish(const char* topic, const char* message)
 }
 //________________________________________________________________________
 //
+// routes added before connect are subscribed on MQTT_EVENT_CONNECTED
+void Mqtt::subscribeTopic(const char* name)
+{
+    if(!connected()) return;
+    std::string topic;
+    string_format(topic, "dst/%s/%s", Sys::hostname(), name);
+    mqttSubscribe(topic.c_str());
+}
+
 void Mqtt::mqttSubscribe(const char* topic)
 {
     INFO("Subscribing to topic %s ", topic);
@@ -20,7 +20,7 @@ extern "C" {
 }
 #include <coroutine.h>
 #include <Streams.h>
-#include <ArduinoJson.h>
+#include <MqttCodec.h>
 
 // #define ADDRESS "tcp://test.mosquitto.org:1883"
 //#define CLIENTID "microAkka"
@@ -28,136 +28,10 @@ extern "C" {
 //#define PAYLOAD "[\"pclat/aliveChecker\",1234,23,\"hello\"]"
 #define QOS 0
 #define TIMEOUT 10000L
-//____________________________________________________________________________________________________________
-//
-typedef struct MqttMessage {
-    std::string topic;
-    std::string message;
-} MqttMessage;
-//____________________________________________________________________________________________________________
-//
-template <class T>
-class MqttFlow : public Flow<T, T>
-{
-    std::string _name;
-
-public:
-    LambdaSink<MqttMessage> mqttIn;
-    ValueFlow<MqttMessage> mqttOut;
-    MqttFlow(std::string name): _name(name)
-    {
-        mqttIn =  *new LambdaSink<MqttMessage>([&](const MqttMessage& msg) {
-            onNext(msg);
-        });
-    };
-
-    void onNext(const T& event)
-    {
-//       INFO(" topic : %s ",_name.c_str());
-        std::string s;
-        DynamicJsonDocument doc(100);
-        JsonVariant variant = doc.to<JsonVariant>();
-        variant.set(event);
-        serializeJson(doc, s);
-        mqttOut.emit({_name, s});
-        // emit doesn't work as such
-        // https://stackoverflow.com/questions/9941987/there-are-no-arguments-that-depend-on-a-template-parameter
-    }
-
-    void onNext(const MqttMessage& mqttMessage)
-    {
-        if(mqttMessage.topic != _name) return;
-//       INFO(" topic : %s ",_name.c_str());
-
-        DynamicJsonDocument doc(100);
-        auto error = deserializeJson(doc, mqttMessage.message);
-        if(error) {
-            WARN(" failed JSON parsing '%s' : '%s' ", mqttMessage.message.c_str(), error.c_str());
-            return;
-        }
-        JsonVariant variant = doc.as<JsonVariant>();
-        if(variant.isNull()) {
-            WARN(" is not a JSON variant '%s' ", mqttMessage.message.c_str());
-            return;
-        }
-        if(variant.is<T>() == false) {
-            WARN(" message '%s' JSON type doesn't match.", mqttMessage.message.c_str());
-            return;
-        }
-        T value = variant.as<T>();
-        this->emit(value);
-        // emit doesn't work as such
-        // https://stackoverflow.com/questions/9941987/there-are-no-arguments-that-depend-on-a-template-parameter
-    }
-
-    void request() {};
-};
-//____________________________________________________________________________________________________________
-//
-template <class T>
-class ToMqtt : public Flow<T, MqttMessage>
-{
-    std::string _name;
-
-public:
-    ToMqtt(std::string name)
-        : _name(name) {};
-    void onNext(const T& event)
-    {
-        std::string s;
-        DynamicJsonDocument doc(100);
-        JsonVariant variant = doc.to<JsonVariant>();
-        variant.set(event);
-        serializeJson(doc, s);
-        this->emit({_name, s});
-        // emit doesn't work as such
-        // https://stackoverflow.com/questions/9941987/there-are-no-arguments-that-depend-on-a-template-parameter
-    }
-    void request() {};
-};
-
-//_______________________________________________________________________________________________________________
-//
-template <class T>
-class FromMqtt : public Flow<MqttMessage, T>
-{
-    std::string _name;
-
-public:
-    FromMqtt(std::string name)
-        : _name(name) {};
-    void onNext(const MqttMessage& mqttMessage)
-    {
-        if(mqttMessage.topic != _name) {
-            return;
-        }
-        DynamicJsonDocument doc(100);
-        auto error = deserializeJson(doc, mqttMessage.message);
-        if(error) {
-            WARN(" failed JSON parsing '%s' : '%s' ", mqttMessage.message.c_str(), error.c_str());
-            return;
-        }
-        JsonVariant variant = doc.as<JsonVariant>();
-        if(variant.isNull()) {
-            WARN(" is not a JSON variant '%s' ", mqttMessage.message.c_str());
-            return;
-        }
-        if(variant.is<T>() == false) {
-            WARN(" message '%s' JSON type doesn't match.", mqttMessage.message.c_str());
-            return;
-        }
-        T value = variant.as<T>();
-        this->emit(value);
-        // emit doesn't work as such
-        // https://stackoverflow.com/questions/9941987/there-are-no-arguments-that-depend-on-a-template-parameter
-    }
-    void request() {};
-};
 
 class Mqtt : public Sink<TimerMsg>, public Flow<MqttMessage, MqttMessage>
 {
 
-    StaticJsonDocument<3000> _jsonBuffer;
     std::string _clientId;
     std::string _address;
     esp_mqtt_client_handle_t _mqttClient;
@@ -165,6 +39,11 @@ class Mqtt : public Sink<TimerMsg>, public Flow<MqttMessage, MqttMessage>
     std::string _lwt_message;
     Timer _reportTimer;
     std::string _hostPrefix;
+    std::string _publishTopic;
+    MqttRouter _router;
+    MqttTopics _topics;
+
+    void subscribeTopic(const char* name);
 
 public:
     AsyncFlow<MqttMessage> outgoing;
@@ -190,21 +69,27 @@ public:
     template <class T>
     Sink<T>& toTopic(const char* name)
     {
-        return *(new ToMqtt<T>(name)) >> outgoing;
+        _topics.add(name);
+        return topology.make<ToMqtt<T>>(name) >> outgoing;
     }
+    // name can be a filter with '+' and '#', only fromTopic and topic
+    // names are subscribed at the broker, also when added after connect
     template <class T>
     Source<T>& fromTopic(const char* name)
     {
-        auto newSource = new FromMqtt<T>(name);
-        incoming >> *newSource;
+        auto newSource = &topology.make<FromMqtt<T>>(name);
+        _router.add(name, *newSource);
+        subscribeTopic(name);
         return *newSource;
     }
 
     template <class T>
     MqttFlow<T>& topic(const char* name)
     {
-        auto newFlow = new MqttFlow<T>(name);
-        incoming >> newFlow->mqttIn;
+        _topics.add(name);
+        auto newFlow = &topology.make<MqttFlow<T>>(name);
+        _router.add(name, newFlow->mqttIn);
+        subscribeTopic(name);
         newFlow->mqttOut >> outgoing;
         return *newFlow;
     }
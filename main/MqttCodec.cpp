@@ -0,0 +1,251 @@
+#include <MqttCodec.h>
+#include <stdlib.h>
+//____________________________________________________________________________________________________________
+//
+// MqttBuffer pool, a free bit per slot taken with compare-exchange so no lock
+// is needed in task or ISR context.
+//
+static_assert(MQTT_POOL_BUFFERS <= 32, "MQTT_POOL_BUFFERS doesn't fit the free mask");
+
+struct MqttPoolSlot {
+    MqttBuffer buffer;
+    char data[MQTT_POOL_BUFFER_SIZE];
+};
+static MqttPoolSlot mqttPool[MQTT_POOL_BUFFERS];
+static std::atomic<uint32_t> mqttPoolFree((uint32_t)((1ULL << MQTT_POOL_BUFFERS) - 1));
+static std::atomic<uint32_t> mqttPoolHighWater(0);
+static std::atomic<uint32_t> mqttPoolFallbacks(0);
+
+MqttBuffer* MqttBuffer::allocate(size_t size)
+{
+    MqttBuffer* buffer = 0;
+    if(size <= MQTT_POOL_BUFFER_SIZE) {
+        uint32_t mask = mqttPoolFree.load(std::memory_order_relaxed);
+        while(mask) {
+            uint32_t bit = mask & (~mask + 1);
+            if(mqttPoolFree.compare_exchange_weak(mask, mask & ~bit, std::memory_order_acquire)) {
+                int16_t slot = __builtin_ctz(bit);
+                buffer = &mqttPool[slot].buffer;
+                buffer->_slot = slot;
+                uint32_t used = MQTT_POOL_BUFFERS - __builtin_popcount(mask & ~bit);
+                uint32_t high = mqttPoolHighWater.load(std::memory_order_relaxed);
+                while(used > high && !mqttPoolHighWater.compare_exchange_weak(high, used)) {}
+                break;
+            }
+        }
+    }
+    if(buffer == 0) {
+        mqttPoolFallbacks.fetch_add(1, std::memory_order_relaxed);
+        buffer = (MqttBuffer*)malloc(sizeof(MqttBuffer) + size);
+        if(buffer == 0) return 0;
+        buffer->_slot = -1;
+    }
+    buffer->_references.store(1, std::memory_order_relaxed);
+    return buffer;
+}
+
+void MqttBuffer::release()
+{
+    if(_references.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    if(_slot < 0) {
+        free(this);
+    } else {
+        mqttPoolFree.fetch_or(1UL << _slot, std::memory_order_release);
+    }
+}
+
+uint32_t MqttBuffer::available()
+{
+    return __builtin_popcount(mqttPoolFree.load(std::memory_order_relaxed));
+}
+
+uint32_t MqttBuffer::highWater()
+{
+    return mqttPoolHighWater.load(std::memory_order_relaxed);
+}
+
+uint32_t MqttBuffer::fallbacks()
+{
+    return mqttPoolFallbacks.load(std::memory_order_relaxed);
+}
+//____________________________________________________________________________________________________________
+//
+void MqttMessage::init(const char* topic, size_t topicLength, const char* message, size_t messageLength)
+{
+    _buffer = MqttBuffer::allocate(topicLength + messageLength + 2);
+    if(_buffer == 0) return;
+    char* t = _buffer->data();
+    if(topicLength) memcpy(t, topic, topicLength);
+    t[topicLength] = '\0';
+    char* m = t + topicLength + 1;
+    if(message && messageLength) memcpy(m, message, messageLength);
+    m[messageLength] = '\0';
+    this->topic = MqttString(t, topicLength);
+    this->message = MqttString(m, messageLength);
+}
+//____________________________________________________________________________________________________________
+//
+void MqttRouter::add(const std::string& topic, Observer<MqttMessage>& observer)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _routes.push_back({mqttHash(topic.data(), topic.length()), topic, &observer, -1});
+    if(mqttWildcard(topic)) {
+        if(_levels.empty()) _levels.push_back(Level());
+        uint16_t node = 0;
+        size_t start = 0;
+        while(true) {
+            size_t slash = topic.find('/', start);
+            std::string name = topic.substr(start, slash == std::string::npos ? std::string::npos : slash - start);
+            uint16_t next = 0;
+            for(uint16_t child : _levels[node].children)
+                if(_levels[child].name == name) next = child;
+            if(next == 0) {
+                next = _levels.size();
+                _levels.push_back(Level());
+                _levels[next].name = name;
+                _levels[node].children.push_back(next);
+            }
+            node = next;
+            if(slash == std::string::npos) break;
+            start = slash + 1;
+        }
+        _levels[node].observers.push_back(&observer);
+        return;
+    }
+    size_t size = 8;
+    while(size < 2 * _routes.size()) size *= 2;
+    _buckets.assign(size, -1);
+    for(size_t i = _routes.size(); i-- > 0;) { // rebuild, chains keep insertion order
+        if(mqttWildcard(_routes[i].topic)) continue;
+        int16_t& head = _buckets[_routes[i].hash & (size - 1)];
+        _routes[i].next = head;
+        head = i;
+    }
+}
+
+void MqttRouter::deliver(Level& level, const MqttMessage& message, bool& routed)
+{
+    for(auto observer : level.observers) observer->onNext(message);
+    routed |= !level.observers.empty();
+}
+// s is the start of the next topic level, last when the topic has no more levels
+void MqttRouter::match(uint16_t node, const char* s, const char* end, bool last,
+                       const MqttMessage& message, bool& routed)
+{
+    const char* slash = last ? end : (const char*)memchr(s, '/', end - s);
+    const char* levelEnd = slash ? slash : end;
+    for(uint16_t c : _levels[node].children) {
+        Level& child = _levels[c];
+        if(child.name == "#") {
+            deliver(child, message, routed);
+        } else if(last) {
+            continue;
+        } else if(child.name == "+" || child.name.compare(0, std::string::npos, s, levelEnd - s) == 0) {
+            if(slash) {
+                match(c, slash + 1, end, false, message, routed);
+            } else {
+                deliver(child, message, routed);
+                match(c, end, end, true, message, routed); // "a/#" matches "a"
+            }
+        }
+    }
+}
+
+void MqttRouter::onNext(const MqttMessage& message)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    bool routed = false;
+    if(_buckets.size()) {
+        uint32_t h = message.topicId ? message.topicId
+                     : mqttHash(message.topic.data(), message.topic.length());
+        for(int16_t i = _buckets[h & (_buckets.size() - 1)]; i >= 0; i = _routes[i].next) {
+            Route& route = _routes[i];
+            if(route.hash == h && message.topic == route.topic) {
+                route.observer->onNext(message);
+                routed = true;
+            }
+        }
+    }
+    if(_levels.size()) {
+        const char* topic = message.topic.data();
+        match(0, topic, topic + message.topic.length(), false, message, routed);
+    }
+    if(!routed) _unrouted++;
+}
+//____________________________________________________________________________________________________________
+//
+// filter a covers filter b when every topic matching b also matches a
+//
+static bool mqttCovers(const std::string& a, const std::string& b)
+{
+    size_t i = 0, j = 0;
+    while(true) {
+        size_t ai = a.find('/', i), bj = b.find('/', j);
+        std::string la = a.substr(i, ai == std::string::npos ? ai : ai - i);
+        if(la == "#") return true;
+        if(j == std::string::npos) return false; // b has no more levels
+        std::string lb = b.substr(j, bj == std::string::npos ? bj : bj - j);
+        if(lb == "#") return false;
+        if(la != "+" && la != lb) return false;
+        if(ai == std::string::npos) return bj == std::string::npos;
+        i = ai + 1;
+        j = bj == std::string::npos ? bj : bj + 1;
+    }
+}
+
+std::vector<std::string> MqttRouter::subscriptions()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<std::string> filters;
+    for(size_t i = 0; i < _routes.size(); i++) {
+        bool covered = false;
+        for(size_t k = 0; k < _routes.size() && !covered; k++) {
+            if(k == i || !mqttCovers(_routes[k].topic, _routes[i].topic)) continue;
+            // of two equal filters only the first one is kept
+            covered = !mqttCovers(_routes[i].topic, _routes[k].topic) || k < i;
+        }
+        if(!covered) filters.push_back(_routes[i].topic);
+    }
+    return filters;
+}
+//____________________________________________________________________________________________________________
+//
+void MqttTopics::add(const MqttTopic& topic)
+{
+    auto it = _entries.begin();
+    while(it != _entries.end() && it->id < topic.id) it++;
+    if(it != _entries.end() && it->id == topic.id) {
+        if(strcmp(it->name, topic.name) == 0) return;
+        WARN(" topic id collision '%s' '%s' ", it->name, topic.name);
+        it->prefixed.clear();
+        return;
+    }
+    it = _entries.insert(it, {topic.id, topic.name, _prefix});
+    it->prefixed += topic.name;
+}
+
+void MqttTopics::prefix(const std::string& prefix)
+{
+    _prefix = prefix;
+    for(auto& entry : _entries) {
+        if(entry.prefixed.empty()) continue;
+        entry.prefixed = prefix;
+        entry.prefixed += entry.name;
+    }
+}
+
+const std::string* MqttTopics::prefixed(const MqttMessage& message)
+{
+    if(message.topicId == 0) return 0;
+    size_t low = 0, high = _entries.size();
+    while(low < high) {
+        size_t mid = (low + high) / 2;
+        if(_entries[mid].id < message.topicId) low = mid + 1;
+        else high = mid;
+    }
+    if(low == _entries.size() || _entries[low].id != message.topicId) return 0;
+    Entry& entry = _entries[low];
+    if(entry.prefixed.empty()) return 0;
+    if(entry.name != message.topic.data() && !message.topic.equals(entry.name, strlen(entry.name))) return 0;
+    return &entry.prefixed;
+}
@@ -0,0 +1,541 @@
+#ifndef MQTTCODEC_H
+#define MQTTCODEC_H
+//____________________________________________________________________________________________________________
+//
+// MQTT message and the JSON codec flows shared by Mqtt and MqttSerial.
+// No ESP-IDF dependency so it also builds on the host ( see bench/ )
+//
+#include <string>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits>
+#include <type_traits>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <Streams.h>
+#include <ArduinoJson.h>
+
+//____________________________________________________________________________________________________________
+//
+// MqttBuffer : topic and payload of one message, NUL terminated, back to back.
+// Taken from a fixed pool so message bursts don't fragment the heap, only
+// oversized messages or an exhausted pool fall back to the heap. Lock free,
+// a message can be built in an ISR.
+//
+#ifndef MQTT_POOL_BUFFERS
+#define MQTT_POOL_BUFFERS 32 // max 32
+#endif
+#ifndef MQTT_POOL_BUFFER_SIZE
+#define MQTT_POOL_BUFFER_SIZE 128
+#endif
+// incoming and outgoing queue depth of a transport, both full still leave
+// pool buffers for the messages being built, decoded or published
+#ifndef MQTT_QUEUE_DEPTH
+#define MQTT_QUEUE_DEPTH 12
+#endif
+static_assert(2 * MQTT_QUEUE_DEPTH + 8 <= MQTT_POOL_BUFFERS, "MQTT queues can drain the buffer pool");
+class MqttBuffer
+{
+    std::atomic<uint16_t> _references;
+    int16_t _slot; // -1 : heap
+
+public:
+    static MqttBuffer* allocate(size_t size);
+    void retain() { _references.fetch_add(1, std::memory_order_relaxed); }
+    void release();
+    bool shared() { return _references.load(std::memory_order_acquire) > 1; }
+    char* data() { return (char*)(this + 1); }
+
+    static uint32_t available();  // free pool buffers
+    static uint32_t highWater();  // most pool buffers in use at once
+    static uint32_t fallbacks();  // allocations that went to the heap
+};
+//____________________________________________________________________________________________________________
+//
+// MqttString : view on a topic or payload inside a MqttBuffer
+//
+class MqttString
+{
+    const char* _data;
+    uint32_t _length;
+
+public:
+    MqttString() : _data(""), _length(0) {}
+    MqttString(const char* data, size_t length) : _data(data), _length(length) {}
+    const char* c_str() const { return _data; }
+    const char* data() const { return _data; }
+    size_t length() const { return _length; }
+    size_t size() const { return _length; }
+    bool empty() const { return _length == 0; }
+    std::string str() const { return std::string(_data, _length); }
+    bool equals(const char* s, size_t length) const
+    {
+        return length == _length && memcmp(s, _data, length) == 0;
+    }
+    bool operator==(const std::string& s) const { return equals(s.data(), s.length()); }
+    bool operator!=(const std::string& s) const { return !equals(s.data(), s.length()); }
+    bool operator==(const char* s) const { return equals(s, strlen(s)); }
+    bool operator!=(const char* s) const { return !equals(s, strlen(s)); }
+};
+//____________________________________________________________________________________________________________
+//
+// MqttTopic : topic literal with its length and FNV-1a id, constexpr so a
+// constant topic is hashed at compile time. Messages of an interned topic
+// carry only the id and a view on the literal, the transport maps the id to
+// the prefixed name it built once. The name must outlive the topology.
+//
+constexpr uint32_t mqttHash(const char* s, size_t length, uint32_t h = 2166136261u)
+{
+    return length == 0 ? h : mqttHash(s + 1, length - 1, (h ^ (uint8_t)*s) * 16777619u);
+}
+constexpr size_t mqttLength(const char* s)
+{
+    return *s ? 1 + mqttLength(s + 1) : 0;
+}
+struct MqttTopic {
+    const char* name;
+    uint32_t length;
+    uint32_t id;
+    constexpr MqttTopic(const char* n) : name(n), length(mqttLength(n)), id(mqttHash(n, mqttLength(n))) {}
+};
+//____________________________________________________________________________________________________________
+//
+// MqttMessage : handle on a reference counted MqttBuffer, copies share the
+// buffer so a message passes incoming and outgoing queues without reallocation.
+//
+class MqttMessage
+{
+    MqttBuffer* _buffer;
+    void init(const char* topic, size_t topicLength, const char* message, size_t messageLength);
+
+public:
+    MqttString topic;
+    MqttString message;
+    uint32_t topicId = 0; // interned MqttTopic, 0 : topic is only a string
+
+    MqttMessage() : _buffer(0) {}
+    // topic is a view on the literal, only the payload goes in the buffer
+    MqttMessage(const MqttTopic& t, const char* message, size_t messageLength)
+        : topicId(t.id)
+    {
+        init(0, 0, message, messageLength);
+        topic = MqttString(t.name, t.length);
+    }
+    MqttMessage(const char* topic, const char* message)
+    {
+        init(topic, strlen(topic), message, strlen(message));
+    }
+    MqttMessage(const std::string& topic, const std::string& message)
+    {
+        init(topic.data(), topic.length(), message.data(), message.length());
+    }
+    // message 0 leaves the payload to be filled in through payload()
+    MqttMessage(const char* topic, size_t topicLength, const char* message, size_t messageLength)
+    {
+        init(topic, topicLength, message, messageLength);
+    }
+    MqttMessage(const MqttMessage& other)
+        : _buffer(other._buffer), topic(other.topic), message(other.message), topicId(other.topicId)
+    {
+        if(_buffer) _buffer->retain();
+    }
+    MqttMessage(MqttMessage&& other)
+        : _buffer(other._buffer), topic(other.topic), message(other.message), topicId(other.topicId)
+    {
+        other._buffer = 0;
+        other.topic = MqttString();
+        other.message = MqttString();
+        other.topicId = 0;
+    }
+    MqttMessage& operator=(MqttMessage other) // copy or move, then swap
+    {
+        std::swap(_buffer, other._buffer);
+        std::swap(topic, other.topic);
+        std::swap(message, other.message);
+        std::swap(topicId, other.topicId);
+        return *this;
+    }
+    ~MqttMessage()
+    {
+        if(_buffer) _buffer->release();
+    }
+    // writable payload, only while the message is not shared yet
+    char* payload()
+    {
+        return _buffer && !_buffer->shared() ? (char*)message.data() : 0;
+    }
+};
+//____________________________________________________________________________________________________________
+//
+// MQTT topic filter match : '+' is one level, '#' as last level is the rest,
+// including the parent level ( "a/#" matches "a" ).
+//
+inline bool mqttMatch(const char* filter, size_t length, const MqttString& topic)
+{
+    const char* f = filter;
+    const char* fe = f + length;
+    const char* t = topic.data();
+    const char* te = t + topic.length();
+    while(f < fe) {
+        if(*f == '#') return true;
+        if(*f == '+') {
+            while(t < te && *t != '/') t++;
+            f++;
+            continue;
+        }
+        if(t == te) return fe - f == 2 && f[0] == '/' && f[1] == '#';
+        if(*f++ != *t++) return false;
+    }
+    return t == te;
+}
+inline bool mqttMatch(const std::string& filter, const MqttString& topic)
+{
+    return mqttMatch(filter.data(), filter.length(), topic);
+}
+inline bool mqttWildcard(const std::string& filter)
+{
+    return filter.find_first_of("+#") != std::string::npos;
+}
+//____________________________________________________________________________________________________________
+//
+// value to JSON, ArduinoJson handles scalars and strings, overload for structs
+//
+template <class T> struct JsonCapacity {
+    enum { value = 100 };
+};
+template <class T> inline void toJson(JsonVariant variant, const T& value)
+{
+    variant.set(value);
+}
+
+template <> struct JsonCapacity<ThreadStats> {
+    enum { value = JSON_OBJECT_SIZE(7) + JSON_ARRAY_SIZE(THREAD_LATENESS_BUCKETS) };
+};
+inline void toJson(JsonVariant variant, const ThreadStats& stats)
+{
+    JsonObject object = variant.to<JsonObject>();
+    object["dispatched"] = stats.dispatched;
+    object["queueHighWater"] = stats.queueHighWater;
+    object["overflows"] = stats.overflows;
+    JsonArray lateness = object.createNestedArray("lateness");
+    for(uint32_t i = 0; i < THREAD_LATENESS_BUCKETS; i++) lateness.add(stats.lateness[i]);
+    object["busyUs"] = stats.busyUs;
+    object["idleUs"] = stats.idleUs;
+    object["longestRequestUs"] = stats.longestRequestUs;
+}
+// serializes straight into the pooled message buffer, no intermediate string
+inline MqttMessage toMessage(const MqttTopic& topic, const JsonDocument& doc)
+{
+    size_t length = measureJson(doc);
+    MqttMessage msg(topic, 0, length);
+    char* payload = msg.payload();
+    if(payload) serializeJson(doc, payload, length + 1);
+    return msg;
+}
+//____________________________________________________________________________________________________________
+//
+// JsonScalar : bool and numbers formatted in / parsed from a stack buffer,
+// accepting what ArduinoJson's is<T>() accepts for the type.
+//
+inline const char* jsonSpace(const char* s)
+{
+    while(*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n') s++;
+    return s;
+}
+inline bool jsonEnd(const char* end)
+{
+    return *jsonSpace(end) == '\0';
+}
+inline const char* jsonDigits(const char* s)
+{
+    while(*s >= '0' && *s <= '9') s++;
+    return s;
+}
+// end of the JSON number starting at s, 0 if there is none : no '+' or
+// leading zeros, digits on both sides of '.'. An integer stops before
+// fraction or exponent, ArduinoJson sees those as a float. Callers skip the
+// whitespace before it, like deserializeJson does.
+inline const char* jsonNumber(const char* s, bool integer)
+{
+    if(*s == '-') s++;
+    if(*s == '0') s++;
+    else if(*s >= '1' && *s <= '9') s = jsonDigits(s);
+    else return 0;
+    if(integer) return s;
+    if(*s == '.') {
+        if(*++s < '0' || *s > '9') return 0;
+        s = jsonDigits(s);
+    }
+    if(*s == 'e' || *s == 'E') {
+        if(*++s == '+' || *s == '-') s++;
+        if(*s < '0' || *s > '9') return 0;
+        s = jsonDigits(s);
+    }
+    return s;
+}
+template <class T> struct JsonScalar { // integers
+    static int format(char* buffer, size_t size, T value)
+    {
+        return std::is_signed<T>::value ? snprintf(buffer, size, "%lld", (long long)value)
+               : snprintf(buffer, size, "%llu", (unsigned long long)value);
+    }
+    static bool parse(const char* s, T& value)
+    {
+        s = jsonSpace(s);
+        const char* end = jsonNumber(s, true);
+        if(end == 0 || !jsonEnd(end)) return false;
+        errno = 0;
+        if(std::is_signed<T>::value) {
+            long long v = strtoll(s, 0, 10);
+            if(v < (long long)std::numeric_limits<T>::min() || v > (long long)std::numeric_limits<T>::max()) return false;
+            value = v;
+        } else {
+            if(*s == '-') return false; // strtoull would wrap it
+            unsigned long long v = strtoull(s, 0, 10);
+            if(v > (unsigned long long)std::numeric_limits<T>::max()) return false;
+            value = v;
+        }
+        return errno == 0;
+    }
+};
+template <> struct JsonScalar<bool> {
+    static int format(char* buffer, size_t size, bool value)
+    {
+        return snprintf(buffer, size, "%s", value ? "true" : "false");
+    }
+    static bool parse(const char* s, bool& value)
+    {
+        s = jsonSpace(s);
+        if(strncmp(s, "true", 4) == 0 && jsonEnd(s + 4)) value = true;
+        else if(strncmp(s, "false", 5) == 0 && jsonEnd(s + 5)) value = false;
+        else return false;
+        return true;
+    }
+};
+template <class T> struct JsonReal {
+    static int format(char* buffer, size_t size, T value)
+    {
+        if(value != value || value - value != 0) return snprintf(buffer, size, "null"); // NaN, Inf
+        return snprintf(buffer, size, "%.*g", std::numeric_limits<T>::digits10 + 1, (double)value);
+    }
+    static bool parse(const char* s, T& value)
+    {
+        s = jsonSpace(s);
+        const char* end = jsonNumber(s, false); // no nan, inf, hex
+        if(end == 0 || !jsonEnd(end)) return false;
+        value = strtod(s, 0);
+        return true;
+    }
+};
+template <> struct JsonScalar<float> : JsonReal<float> {};
+template <> struct JsonScalar<double> : JsonReal<double> {};
+//____________________________________________________________________________________________________________
+//
+// JsonCodec : value <-> MQTT payload. Compound values use a document on the
+// stack of the encoding or decoding thread, a document per flow would take
+// its capacity from the topology arena for every toTopic. Scalars don't need
+// one.
+//
+template <class T, class Enable = void>
+class JsonCodec
+{
+public:
+    MqttMessage encode(const MqttTopic& topic, const T& value)
+    {
+        StaticJsonDocument<JsonCapacity<T>::value> doc;
+        toJson(doc.template to<JsonVariant>(), value);
+        return toMessage(topic, doc);
+    }
+    bool decode(const MqttString& message, T& value)
+    {
+        StaticJsonDocument<JsonCapacity<T>::value> doc;
+        auto error = deserializeJson(doc, message.data(), message.length());
+        if(error) {
+            WARN(" failed JSON parsing '%s' : '%s' ", message.c_str(), error.c_str());
+            return false;
+        }
+        JsonVariant variant = doc.template as<JsonVariant>();
+        if(variant.isNull()) {
+            WARN(" is not a JSON variant '%s' ", message.c_str());
+            return false;
+        }
+        if(variant.template is<T>() == false) {
+            WARN(" message '%s' JSON type doesn't match.", message.c_str());
+            return false;
+        }
+        value = variant.template as<T>();
+        return true;
+    }
+};
+
+template <class T>
+class JsonCodec<T, typename std::enable_if<std::is_arithmetic<T>::value>::type>
+{
+public:
+    MqttMessage encode(const MqttTopic& topic, const T& value)
+    {
+        char buffer[32];
+        int length = JsonScalar<T>::format(buffer, sizeof(buffer), value);
+        return MqttMessage(topic, buffer, length);
+    }
+    bool decode(const MqttString& message, T& value)
+    {
+        if(JsonScalar<T>::parse(message.c_str(), value)) return true;
+        WARN(" message '%s' JSON type doesn't match.", message.c_str());
+        return false;
+    }
+};
+//____________________________________________________________________________________________________________
+//
+template <class T>
+class MqttFlow : public Flow<T, T>
+{
+    MqttTopic _topic;
+    JsonCodec<T> _codec;
+
+public:
+    LambdaSink<MqttMessage> mqttIn;
+    ValueFlow<MqttMessage> mqttOut;
+    MqttFlow(MqttTopic topic): _topic(topic)
+    {
+        mqttIn.handler([&](const MqttMessage& msg) {
+            onNext(msg);
+        });
+    };
+
+    // encoded values leave through mqttOut, its observers limit the demand
+    uint32_t demand() { return mqttOut.downstreamDemand(); }
+
+    void onNext(const T& event)
+    {
+//       INFO(" topic : %s ",_topic.name);
+        mqttOut.emit(_codec.encode(_topic, event));
+        // emit doesn't work as such
+        // https://stackoverflow.com/questions/9941987/there-are-no-arguments-that-depend-on-a-template-parameter
+    }
+
+    void onNext(const MqttMessage& mqttMessage)
+    {
+        if(!mqttMatch(_topic.name, _topic.length, mqttMessage.topic)) return;
+//       INFO(" topic : %s ",_topic.name);
+        T value;
+        if(!_codec.decode(mqttMessage.message, value)) return;
+        this->emit(std::move(value));
+        // emit doesn't work as such
+        // https://stackoverflow.com/questions/9941987/there-are-no-arguments-that-depend-on-a-template-parameter
+    }
+
+    void request() {};
+};
+//____________________________________________________________________________________________________________
+//
+template <class T>
+class ToMqtt : public Flow<T, MqttMessage>
+{
+    MqttTopic _topic;
+    JsonCodec<T> _codec;
+
+public:
+    ToMqtt(MqttTopic topic)
+        : _topic(topic) {};
+    void onNext(const T& event)
+    {
+        this->emit(_codec.encode(_topic, event));
+        // emit doesn't work as such
+        // https://stackoverflow.com/questions/9941987/there-are-no-arguments-that-depend-on-a-template-parameter
+    }
+    void onNextBatch(const T* values, size_t count)
+    {
+        BatchEmitter<MqttMessage> out(*this);
+        for(size_t i = 0; i < count; i++) out.add(_codec.encode(_topic, values[i]));
+    }
+    void request() {};
+};
+
+//_______________________________________________________________________________________________________________
+//
+template <class T>
+class FromMqtt : public Flow<MqttMessage, T>
+{
+    MqttTopic _topic;
+    JsonCodec<T> _codec;
+
+public:
+    FromMqtt(MqttTopic topic)
+        : _topic(topic) {};
+    void onNext(const MqttMessage& mqttMessage)
+    {
+        if(!mqttMatch(_topic.name, _topic.length, mqttMessage.topic)) {
+            return;
+        }
+        T value;
+        if(!_codec.decode(mqttMessage.message, value)) return;
+        this->emit(std::move(value));
+        // emit doesn't work as such
+        // https://stackoverflow.com/questions/9941987/there-are-no-arguments-that-depend-on-a-template-parameter
+    }
+    void request() {};
+};
+//_______________________________________________________________________________________________________________
+//
+// MqttRouter : one subscriber of incoming that hands each message only to the
+// flows registered for its topic. Plain topics are found through a hash table,
+// filters with '+' or '#' through a trie of topic levels. Both are built at
+// setup, lookups run on the incoming thread.
+//
+class MqttRouter : public Sink<MqttMessage>
+{
+    struct Route {
+        uint32_t hash;
+        std::string topic;
+        Observer<MqttMessage>* observer;
+        int16_t next; // same bucket, -1 : end
+    };
+    struct Level {
+        std::string name; // level, "+" or "#"
+        std::vector<uint16_t> children;
+        std::vector<Observer<MqttMessage>*> observers;
+    };
+    std::vector<Route> _routes;
+    std::vector<int16_t> _buckets; // power of 2, first route index or -1
+    std::vector<Level> _levels;    // trie, [0] is the root
+    uint32_t _unrouted = 0;
+    std::mutex _mutex; // add() from setup races the MQTT task delivering
+
+    void match(uint16_t level, const char* s, const char* end, bool last,
+               const MqttMessage& message, bool& routed);
+    void deliver(Level& level, const MqttMessage& message, bool& routed);
+
+public:
+    void add(const std::string& topic, Observer<MqttMessage>& observer);
+    void onNext(const MqttMessage& message);
+    uint32_t unrouted() { return _unrouted; } // messages without subscriber
+    // smallest set of filters covering every route, to subscribe at the broker
+    std::vector<std::string> subscriptions();
+};
+//_______________________________________________________________________________________________________________
+//
+// MqttTopics : interned topic ids of a transport, mapped to the prefixed topic
+// name. The names are built at setup, publishing a message with a topic id
+// doesn't build strings anymore.
+//
+class MqttTopics
+{
+    struct Entry {
+        uint32_t id;
+        const char* name;
+        std::string prefixed; // empty : id collides with another name
+    };
+    std::vector<Entry> _entries; // sorted on id
+    std::string _prefix;
+
+public:
+    void add(const MqttTopic& topic);
+    void prefix(const std::string& prefix); // rebuilds the prefixed names
+    const std::string* prefixed(const MqttMessage& message); // 0 : not interned
+};
+
+#endif // MQTTCODEC_H
@@ -6,13 +6,15 @@
 
 MqttSerial::MqttSerial() :_uart(UART::create(UART_NUM_0,1,3))
     , connected(false)
-    , incoming(20)
-    , outgoing(20)
+    , incoming(MQTT_QUEUE_DEPTH)
+    , outgoing(MQTT_QUEUE_DEPTH)
     , keepAliveTimer(TIMER_KEEP_ALIVE, 1000, true)
     , connectTimer(TIMER_CONNECT, 3000, true)
     , serialTimer(TIMER_SERIAL, 10, true)
 {
     _rxdString.reserve(256);
+    _txdString.reserve(256);
+    _publishTopic.reserve(64);
 }
 MqttSerial::~MqttSerial() {}
 
@@ -24,12 +26,15 @@ void MqttSerial::init()
     _hostPrefix = "src/";
     _hostPrefix += Sys::hostname();
     _hostPrefix += "/";
+    _topics.prefix(_hostPrefix);
     _loopbackTopic += "dst/";
     _loopbackTopic+= Sys::hostname();
     _loopbackTopic += "/system/loopback";
     _loopbackReceived = 0;
+    outgoing.backpressure(true); // full queue holds back polled telemetry
     outgoing >> *this;
     *this >> incoming;
+    incoming >> _router; // delivers to fromTopic and topic flows by topic
     Sink<TimerMsg>& me = *this;
     keepAliveTimer >> me;
     connectTimer >> me;
@@ -45,17 +50,18 @@ void MqttSerial::onNext(const TimerMsg& tm)
 {
     // LOG(" timer : %lu ",tm.id);
     if(tm.id == TIMER_KEEP_ALIVE) {
-        publish(_loopbackTopic, std::string("true"));
+        publish(_loopbackTopic, "true");
         outgoing.onNext({"system/alive", "true"});
     } else if(tm.id == TIMER_CONNECT) {
         if(Sys::millis() > (_loopbackReceived + 2000)) {
             connected = false;
-            std::string topic;
-            string_format(topic, "dst/%s/#", Sys::hostname());
-            subscribe(topic);
+            subscribeRoutes();
+            subscribe(_loopbackTopic);
             publish(_loopbackTopic, "true");
         } else {
             connected = true;
+            // the serial link is only written from this thread
+            if(_resubscribe.exchange(false)) subscribeRoutes();
         }
     } else if(tm.id == TIMER_SERIAL) {
         /*	//   LOG("TIMER_SERIAL");
@@ -71,8 +77,13 @@ void MqttSerial::onNext(const TimerMsg& tm)
 void MqttSerial::onNext(const MqttMessage& m)
 {
     if(connected()) {
-        std::string topic = _hostPrefix+m.topic;
-        publish(topic, m.message);
+        const std::string* topic = _topics.prefixed(m);
+        if(topic == 0) { // not a toTopic/topic name
+            _publishTopic.assign(_hostPrefix);
+            _publishTopic.append(m.topic.data(), m.topic.length());
+            topic = &_publishTopic;
+        }
+        publish(*topic, m.message.c_str());
     };
 }
 
@@ -117,21 +128,27 @@ void MqttSerial::handleSerialByte(uint8_t b)
 
 void MqttSerial::rxdSerial(std::string&  rxdString)
 {
-    deserializeJson(rxd, rxdString);
+    // parsed in place, topic and message point into the line buffer until
+    // they're copied once into a pooled message
+    deserializeJson(rxd, &rxdString[0]);
     JsonArray array = rxd.as<JsonArray>();
     if(!array.isNull()) {
-        if(array[1].as<std::string>() == _loopbackTopic) {
+        const char* topic = array[1];
+        const char* message = array[2];
+        if(topic == 0 || message == 0) {
+            WARN(" topic or message is not a string ");
+        } else if(_loopbackTopic == topic) {
             _loopbackReceived = Sys::millis();
-        } else {
-            std::string topic = array[1];
-            emit({topic.substr(_hostPrefix.length()), array[2]});
+        } else if(strlen(topic) >= _hostPrefix.length()) {
+            emit(MqttMessage(topic + _hostPrefix.length(), strlen(topic) - _hostPrefix.length(),
+                             message, strlen(message)));
         }
     } else {
         WARN(" parsing JSON array failed ");
     }
 }
 
-void MqttSerial::publish(std::string& topic, std::string message)
+void MqttSerial::publish(const std::string& topic, const char* message)
 {
     txd.clear();
     txd.add((int)CMD_PUBLISH);
@@ -140,7 +157,17 @@ void MqttSerial::publish(std::string& topic, std::string message)
     txdSerial(txd);
 }
 
-void MqttSerial::subscribe(std::string& topic)
+// only what fromTopic/topic consume, not dst/<host>/#
+void MqttSerial::subscribeRoutes()
+{
+    std::string topic;
+    for(auto& filter : _router.subscriptions()) {
+        string_format(topic, "dst/%s/%s", Sys::hostname(), filter.c_str());
+        subscribe(topic);
+    }
+}
+
+void MqttSerial::subscribe(const std::string& topic)
 {
     txd.clear();
     txd.add((int)CMD_SUBSCRIBE);
@@ -150,7 +177,7 @@ void MqttSerial::subscribe(std::string& topic)
 
 void MqttSerial::txdSerial(JsonDocument& txd)
 {
-    std::string output = "";
-    serializeJson(txd, output);
-    printf("%s\n",output.c_str());
+    _txdString.clear();
+    serializeJson(txd, _txdString);
+    printf("%s\n",_txdString.c_str());
 }
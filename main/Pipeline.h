@@ -0,0 +1,201 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+#include <Streams.h>
+#include <MedianFilter.h>
+//__________________________________________________________________________`
+//
+// Pipeline : chain of stages fused at compile time into one inlined call
+// chain, no heap, no observer vector and no virtual call between stages.
+// Only the output of the pipeline is a normal Flow emit.
+//
+//	Pipeline<MedianStage<int32_t, 5>, ThrottleStage<int32_t>> p(
+//	    MedianStage<int32_t, 5>(), ThrottleStage<int32_t>(100));
+//	p >> sink;
+//	p.onNext(value); // direct call, usable from ISR
+//
+// A stage has In and Out types and implements
+//	template <class Next> void onNext(const In &, const Next &next)
+// calling next(out) zero or more times. A stage with timers takes timer ids
+// from subscribeTimers() and only reacts to its own ids in onTimer().
+//__________________________________________________________________________
+template <class IN, class OUT> class Stage {
+	public:
+		typedef IN In;
+		typedef OUT Out;
+		template <class Next> void onTimer(const TimerMsg &, const Next &) {}
+		// returns the first timer id left for the next stages
+		uint32_t subscribeTimers(Sink<TimerMsg> &, uint32_t id) { return id; }
+		void timersOn(Thread &) {}
+};
+//__________________________________________________________________________`
+//
+// MedianStage : see Median
+//
+template <class T, int x> class MedianStage : public Stage<T, T> {
+		MedianFilter<T, x> _mf;
+
+	public:
+		template <class Next> inline void onNext(const T &value, const Next &next) {
+			_mf.addSample(value);
+			if (_mf.isReady())
+				next(_mf.getMedian());
+		}
+};
+//__________________________________________________________________________`
+//
+// MethodStage : see LambdaFlow, calls a member function of object
+//
+template <class C, class IN, class OUT, OUT (C::*M)(IN)>
+class MethodStage : public Stage<IN, OUT> {
+		C *_object;
+
+	public:
+		MethodStage(C *object) : _object(object) {}
+		template <class Next> inline void onNext(const IN &in, const Next &next) {
+			next((_object->*M)(in));
+		}
+};
+//__________________________________________________________________________`
+//
+// FunctionStage : see LambdaFlow, calls a plain function
+//
+template <class IN, class OUT, OUT (*F)(IN)>
+class FunctionStage : public Stage<IN, OUT> {
+	public:
+		template <class Next> inline void onNext(const IN &in, const Next &next) {
+			next(F(in));
+		}
+};
+//__________________________________________________________________________`
+//
+// ThrottleStage : see Throttle
+//
+template <class T> class ThrottleStage : public Stage<T, T> {
+		uint32_t _delta;
+		uint64_t _nextEmit;
+
+	public:
+		ThrottleStage(uint32_t delta) : _delta(delta) {
+			_nextEmit = Sys::millis() + _delta;
+		}
+		template <class Next> inline void onNext(const T &value, const Next &next) {
+			uint64_t now = Sys::millis();
+			if (now > _nextEmit) {
+				next(value);
+				_nextEmit = now + _delta;
+			}
+		}
+};
+//__________________________________________________________________________`
+//
+// TimeoutStage : see TimeoutFlow, on timer expiry defaultValue is passed
+// through the rest of the pipeline from the thread the timer observes on
+//
+template <class T> class TimeoutStage : public Stage<T, T> {
+		T _defaultValue;
+
+	public:
+		TimerSource timer;
+		TimeoutStage(uint32_t timeout, T defaultValue)
+			: _defaultValue(defaultValue), timer(0, timeout, true) {}
+		template <class Next> inline void onNext(const T &t, const Next &next) {
+			next(t);
+			timer.start();
+		}
+		template <class Next> void onTimer(const TimerMsg &tm, const Next &next) {
+			if (tm.id == timer.id())
+				next(_defaultValue);
+		}
+		uint32_t subscribeTimers(Sink<TimerMsg> &sink, uint32_t id) {
+			timer.id(id);
+			timer >> sink;
+			return id + 1;
+		}
+		void timersOn(Thread &thread) { timer.observeOn(thread); }
+};
+//__________________________________________________________________________`
+//
+// StageChain : recursive composition of stages
+//
+template <class... Stages> class StageChain;
+
+template <class S> class StageChain<S> {
+		S _stage;
+
+	public:
+		typedef typename S::In In;
+		typedef typename S::Out Out;
+		StageChain(const S &stage) : _stage(stage) {}
+		template <class Next> inline void onNext(const In &in, const Next &next) {
+			_stage.onNext(in, next);
+		}
+		template <class Next> void onTimer(const TimerMsg &tm, const Next &next) {
+			_stage.onTimer(tm, next);
+		}
+		uint32_t subscribeTimers(Sink<TimerMsg> &sink, uint32_t id) {
+			return _stage.subscribeTimers(sink, id);
+		}
+		void timersOn(Thread &thread) { _stage.timersOn(thread); }
+};
+
+template <class S, class... Rest> class StageChain<S, Rest...> {
+		S _stage;
+		StageChain<Rest...> _rest;
+
+	public:
+		typedef typename S::In In;
+		typedef typename StageChain<Rest...>::Out Out;
+		StageChain(const S &stage, const Rest &... rest)
+			: _stage(stage), _rest(rest...) {}
+		template <class Next> inline void onNext(const In &in, const Next &next) {
+			StageChain<Rest...> &rest = _rest;
+			_stage.onNext(in, [&rest, &next](const typename S::Out &out) {
+				rest.onNext(out, next);
+			});
+		}
+		template <class Next> void onTimer(const TimerMsg &tm, const Next &next) {
+			StageChain<Rest...> &rest = _rest;
+			_stage.onTimer(tm, [&rest, &next](const typename S::Out &out) {
+				rest.onNext(out, next);
+			});
+			_rest.onTimer(tm, next);
+		}
+		uint32_t subscribeTimers(Sink<TimerMsg> &sink, uint32_t id) {
+			return _rest.subscribeTimers(sink, _stage.subscribeTimers(sink, id));
+		}
+		void timersOn(Thread &thread) {
+			_stage.timersOn(thread);
+			_rest.timersOn(thread);
+		}
+};
+//__________________________________________________________________________`
+//
+// Pipeline : a Flow around a StageChain, timers of the stages run on the
+// thread given to timersOn(). Output emitted from a timer is in task
+// context, output of onNext() in the context of the caller.
+//
+template <class... Stages>
+class Pipeline : public Flow<typename StageChain<Stages...>::In,
+	                            typename StageChain<Stages...>::Out>,
+	public Sink<TimerMsg> {
+		typedef typename StageChain<Stages...>::In In;
+		typedef typename StageChain<Stages...>::Out Out;
+		StageChain<Stages...> _chain;
+
+	public:
+		Pipeline(const Stages &... stages) : _chain(stages...) {
+			_chain.subscribeTimers(*this, 1);
+		}
+		inline void onNext(const In &in) {
+			Pipeline *me = this;
+			_chain.onNext(in, [me](const Out &out) { me->emit(out); });
+		}
+		void onNext(const TimerMsg &tm) {
+			Pipeline *me = this;
+			_chain.onTimer(tm, [me](const Out &out) { me->emit(out); });
+		}
+		void request() {}
+		void timersOn(Thread &thread) { _chain.timersOn(thread); }
+};
+
+#endif // PIPELINE_H
@@ -1,4 +1,5 @@
 #include "Streams.h"
+#include <algorithm>
 
 //______________________________________________________________________________
 //
@@ -7,18 +8,211 @@ TimerSource &Thread::operator|(TimerSource &ts) {
   return ts;
 }
 
-void Thread::addTimer(TimerSource *ts) { _timers.push_back(ts); }
+void Thread::addTimer(TimerSource *ts) {
+  if (ts->thread() == this)
+    return; // already in the heap
+  ts->thread(this);
+  _timers.push_back(ts);
+  _timersDirty = true;
+}
 void Thread::addRequestable(Requestable &rq) { _requestables.push_back(&rq); }
 
+static bool expiresLater(TimerSource *a, TimerSource *b) {
+  return a->expireTime() > b->expireTime();
+}
+//______________________________________________________________________________
+//
+// fire every timer due at 'now' once, earliest deadline first
+// returns the next deadline or UINT64_MAX when there are no timers
+//
+static bool deadlineEarlier(TimerSource *a, TimerSource *b) {
+  return a->deadlineTime() < b->deadlineTime();
+}
+
+// earliest latestTime() in the heap below i. Only timers expiring before the
+// best wakeup found so far can lower it, so the walk stops at the first
+// later expiry on each branch and visits just the timers due soon.
+static void earliestLatest(std::vector<TimerSource *> &heap, size_t i,
+                           uint64_t &best) {
+  if (i >= heap.size() || heap[i]->expireTime() >= best)
+    return;
+  if (heap[i]->latestTime() < best)
+    best = heap[i]->latestTime();
+  earliestLatest(heap, 2 * i + 1, best);
+  earliestLatest(heap, 2 * i + 2, best);
+}
+
+// expired timers fire once per pass, earliest deadline first. Returns when
+// the thread must wake again : the earliest expiry plus slack of all timers,
+// timers expiring before that fire in the same wakeup.
+// posted restarts are applied before the heap is rebuilt
+void Thread::reorderTimers(uint64_t now) {
+  for (TimerSource *timer : _timers)
+    timer->applyStart(now);
+  std::make_heap(_timers.begin(), _timers.end(), expiresLater);
+}
+
+uint64_t Thread::fireExpiredTimers(uint64_t now) {
+  if (_timersDirty.exchange(false))
+    reorderTimers(now);
+  while (_timers.size() && _timers.front()->expireTime() <= now) {
+    std::pop_heap(_timers.begin(), _timers.end(), expiresLater);
+    _expired.push_back(_timers.back());
+    _timers.pop_back();
+  }
+  if (_expired.size()) {
+    std::sort(_expired.begin(), _expired.end(), deadlineEarlier);
+    for (TimerSource *timer : _expired) {
+      uint32_t bucket = 0;
+      for (uint64_t late = now - timer->expireTime(); late; late >>= 1)
+        if (bucket < THREAD_LATENESS_BUCKETS - 1)
+          bucket++;
+      _lateness[bucket]++;
+      uint64_t start = Sys::micros();
+      TRACE_ENTER(TRACE_TIMER, timer);
+      timer->request();
+      TRACE_EXIT(TRACE_TIMER, timer);
+      dispatched(start, Sys::micros()); // control loops run in timer handlers
+    }
+    for (TimerSource *timer : _expired) {
+      _timers.push_back(timer);
+      std::push_heap(_timers.begin(), _timers.end(), expiresLater);
+    }
+    _expired.clear();
+    // a handler, ISR or other thread restarted a timer
+    if (_timersDirty.exchange(false))
+      reorderTimers(now);
+  }
+  uint64_t wakeup = UINT64_MAX;
+  earliestLatest(_timers, 0, wakeup);
+  _wakeup = wakeup == UINT64_MAX ? UINT32_MAX : (uint32_t)wakeup;
+  return wakeup;
+}
+
+uint32_t Thread::wakeupIn() {
+  if (hasWork())
+    return 0;
+  uint32_t wakeup = _wakeup;
+  if (wakeup == UINT32_MAX)
+    return UINT32_MAX;
+  int32_t delta = wakeup - (uint32_t)Sys::millis();
+  return delta > 0 ? delta : 0;
+}
+
+static void storeMax(std::atomic<uint32_t> &max, uint32_t value) {
+  uint32_t current = max.load();
+  while (value > current && !max.compare_exchange_weak(current, value))
+    ;
+}
+// called by the awaking side with the entries now in the lane
+void Thread::queued(uint32_t entries) { storeMax(_queueHighWater, entries); }
+
+// busy time is counted per handler, a thread that never idles still
+// reports its load
+void Thread::dispatched(uint64_t start, uint64_t end) {
+  _dispatched++;
+  _busyUs += end - start;
+  storeMax(_longestRequestUs, end - start);
+}
+
+void Thread::idle(uint64_t start, uint64_t end) { _idleUs += end - start; }
+
+ThreadStats Thread::stats() {
+  ThreadStats stats;
+  stats.dispatched = _dispatched.exchange(0);
+  stats.queueHighWater = _queueHighWater.exchange(0);
+  stats.overflows = _overflows.exchange(0);
+  for (uint32_t i = 0; i < THREAD_LATENESS_BUCKETS; i++)
+    stats.lateness[i] = _lateness[i].exchange(0);
+  stats.busyUs = _busyUs.exchange(0);
+  stats.idleUs = _idleUs.exchange(0);
+  stats.longestRequestUs = _longestRequestUs.exchange(0);
+  return stats;
+}
+
+#if defined(FREERTOS) || defined(LINUX)
+Executor::Executor() : _idle(0), _started(0) {
+  for (uint32_t worker = 0; worker < EXECUTOR_WORKERS; worker++)
+    _workers[worker] = 0;
+}
+
+void Executor::add(Thread &thread) {
+  thread._executor = this;
+  _threads.push_back(&thread);
+}
+
+void Executor::workerTask(void *pv) {
+  Executor *executor = (Executor *)pv;
+  executor->work(executor->_started++);
+}
+
+// scan the pooled threads starting at a different one per worker, run each
+// that no other worker holds. Sleep when a full scan found nothing to do.
+void Executor::work(uint32_t worker) {
+  _workers[worker] = Thread::currentId();
+  uint32_t bit = 1 << worker;
+  uint32_t count = _threads.size();
+  while (!_stop) {
+    uint64_t expTime = UINT64_MAX;
+    bool more = false;
+    for (uint32_t i = 0; i < count; i++) {
+      Thread *thread = _threads[(worker + i) % count];
+      if (thread->_claimed.exchange(true))
+        continue; // on another worker
+      thread->_tcb = Thread::currentId();
+      bool threadMore;
+      uint64_t threadExpTime = thread->step(threadMore);
+      thread->_tcb = 0;
+      thread->_claimed = false;
+      more = more || threadMore;
+      if (threadExpTime < expTime)
+        expTime = threadExpTime;
+    }
+    if (more)
+      continue;
+    _idle |= bit; // from here awake() wakes this worker
+    bool work = false; // held threads are rescanned by their worker
+    for (Thread *thread : _threads)
+      work = work || (!thread->_claimed && thread->hasWork());
+    if (!work)
+      wait(expTime);
+    _idle &= ~bit;
+  }
+}
+#endif
+
+//______________________________________________________________________________
+//
+thread_local DemandVisit *DemandVisit::chain = 0;
+//______________________________________________________________________________
+//
+alignas(alignof(std::max_align_t)) static uint8_t topologyBuffer[TOPOLOGY_ARENA_SIZE];
+Arena topology(topologyBuffer, sizeof(topologyBuffer));
+
+void *Arena::allocate(size_t size, size_t align) {
+  uint32_t offset = (_used + align - 1) & ~(align - 1);
+  if (_sealed || offset + size > _size) {
+    WARN(" arena %s, %u bytes from heap ", _sealed ? "sealed" : "full",
+         (uint32_t)size);
+    _overflow += size;
+    return ::operator new(size);
+  }
+  _used = offset + size;
+  return _buffer + offset;
+}
+
 #ifdef ARDUINO
-Thread::Thread(){};
+Thread::Thread(uint32_t queueDepth) { stats(); };
 
 int Thread::awakeRequestable(Requestable *rq) { return 0; };
 int Thread::awakeRequestableFromIsr(Requestable *rq) { return 0; };
+bool Thread::hasWork() { return false; }
 
 void Thread::run() { // ARDUINO single thread version ==> continuous polling
-  for (auto timer : _timers)
+  for (auto timer : _timers) {
+    timer->applyStart(Sys::millis());
     timer->request();
+  }
   for (auto requestable : _requestables)
     requestable->request();
 }
@@ -30,69 +224,326 @@ void *Thread::currentId() { return (void *)1; }
 #endif
 
 #ifdef FREERTOS
-extern void *pxCurrentTCB;
-Thread::Thread() { _workQueue = xQueueCreate(20, sizeof(Requestable *)); };
+Thread::Thread(uint32_t queueDepth) {
+  _tcb = 0;
+  stats(); // zero counters
+  for (uint32_t lane = 0; lane < PRIO_LANES; lane++)
+    _workQueue[lane] = xQueueCreate(queueDepth, sizeof(Requestable *));
+};
 int Thread::awakeRequestable(Requestable *rq) {
-  if (_workQueue)
-    if (xQueueSend(_workQueue, &rq, (TickType_t)0) != pdTRUE) {
+  QueueHandle_t queue = _workQueue[rq->priority()];
+  if (queue == 0 || !rq->schedule())
+    return 0; // already queued, request() will pick up the latest state
+  if (xQueueSend(queue, &rq, (TickType_t)0) != pdTRUE) {
+    rq->unschedule();
+    _overflows++;
+    WARN(" queue overflow ");
+    return ENOBUFS;
+  }
+  queued(uxQueueMessagesWaiting(queue));
+  void *tcb = _tcb;
+  if (_executor)
+    _executor->awake();
+  else if (tcb)
+    xTaskNotifyGive((TaskHandle_t)tcb);
+  return 0;
+};
+int Thread::awakeRequestableFromIsr(Requestable *rq) {
+  QueueHandle_t queue = _workQueue[rq->priority()];
+  if (queue == 0 || !rq->schedule())
+    return 0;
+  BaseType_t higherPriorityTaskWoken = pdFALSE;
+  if (xQueueSendFromISR(queue, &rq, &higherPriorityTaskWoken) != pdTRUE) {
+    rq->unschedule();
+    _overflows++;
+    //  WARN("queue overflow"); // cannot log here concurency issue
+    return ENOBUFS;
+  }
+  queued(uxQueueMessagesWaitingFromISR(queue));
+  void *tcb = _tcb;
+  if (_executor) {
+    if (_executor->awakeFromIsr())
+      higherPriorityTaskWoken = pdTRUE;
+  } else if (tcb)
+    vTaskNotifyGiveFromISR((TaskHandle_t)tcb, &higherPriorityTaskWoken);
+  if (higherPriorityTaskWoken)
+    portYIELD_FROM_ISR();
+  return 0;
+};
+
+void *Thread::id() { return _tcb; }
+
+void *Thread::currentId() { return xTaskGetCurrentTaskHandle(); }
+
+bool Thread::nextRequestable(Requestable *&prq) {
+  for (int lane = PRIO_LANES - 1; lane >= 0; lane--)
+    if (xQueueReceive(_workQueue[lane], &prq, 0) == pdTRUE)
+      return true;
+  return false;
+}
+
+bool Thread::hasWork() {
+  for (uint32_t lane = 0; lane < PRIO_LANES; lane++)
+    if (uxQueueMessagesWaiting(_workQueue[lane]))
+      return true;
+  return false;
+}
+
+// fire expired timers and drain queued work for at most the budget, more is
+// set when the batch stopped with work possibly left. Returns next deadline.
+uint64_t Thread::step(bool &more) {
+  uint64_t expTime = fireExpiredTimers(Sys::millis());
+  more = false;
+  Requestable *prq;
+  if (!nextRequestable(prq))
+    return expTime;
+  // drain high lane first then FIFO order, a source that emits again
+  // during its request() goes to the back of its lane. Timers get served
+  // after each batch.
+  uint64_t start = Sys::micros();
+  uint64_t budgetEnd = start + _budget;
+  do {
+    prq->unschedule(); // new emits during request() queue it again
+    TRACE_ENTER(TRACE_REQUEST, prq);
+    prq->awake();
+    TRACE_EXIT(TRACE_REQUEST, prq);
+    uint64_t end = Sys::micros();
+    dispatched(start, end);
+    start = end;
+    if (end >= budgetEnd || Sys::millis() >= expTime) {
+      more = true;
+      break;
+    }
+  } while (nextRequestable(prq));
+  return expTime;
+}
+
+static TickType_t ticksUntil(uint64_t expTime) {
+  if (expTime == UINT64_MAX)
+    return portMAX_DELAY; // no timers, wait for work only
+  uint64_t now = Sys::millis();
+  return expTime > now ? pdMS_TO_TICKS(expTime - now + portTICK_PERIOD_MS - 1) : 0;
+}
+
+void Thread::run() { // FREERTOS block thread until awake or timer expired.
+  _tcb = currentId();
+  while (true) {
+    bool more;
+    uint64_t expTime = step(more);
+    if (more || hasWork())
+      continue;
+    uint64_t idleStart = Sys::micros();
+    ulTaskNotifyTake(pdTRUE, ticksUntil(expTime));
+    idle(idleStart, Sys::micros());
+  }
+}
+
+void Executor::start(uint32_t stackSize, uint32_t priority) {
+  for (uint32_t worker = 0; worker < EXECUTOR_WORKERS; worker++)
+    xTaskCreatePinnedToCore(workerTask, "executor", stackSize, this, priority,
+                            NULL, worker % portNUM_PROCESSORS);
+}
+
+void Executor::awake() {
+  uint32_t idle = _idle.load();
+  if (idle)
+    xTaskNotifyGive((TaskHandle_t)_workers[__builtin_ctz(idle)]);
+}
+
+bool Executor::awakeFromIsr() {
+  BaseType_t higherPriorityTaskWoken = pdFALSE;
+  uint32_t idle = _idle.load();
+  if (idle)
+    vTaskNotifyGiveFromISR((TaskHandle_t)_workers[__builtin_ctz(idle)],
+                           &higherPriorityTaskWoken);
+  return higherPriorityTaskWoken == pdTRUE;
+}
+
+// a notification given between the last scan and the wait is not lost, the
+// wait returns immediately
+void Executor::wait(uint64_t expTime) {
+  ulTaskNotifyTake(pdTRUE, ticksUntil(expTime));
+}
+
+#endif // FREERTOS
+
+#ifdef LINUX
+#include <pthread.h>
+#include <cerrno>
+
+Thread::Thread(uint32_t queueDepth) : _queueDepth(queueDepth) {
+  _tcb = 0;
+  stats(); // zero counters
+};
+
+Thread::~Thread() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _condition.notify_all();
+  if (_thread.joinable())
+    _thread.join();
+}
+
+int Thread::awakeRequestable(Requestable *rq) {
+  if (!rq->schedule())
+    return 0; // already queued
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::deque<Requestable *> &lane = _workQueue[rq->priority()];
+    if (lane.size() >= _queueDepth) {
+      rq->unschedule();
+      _overflows++;
       WARN(" queue overflow ");
       return ENOBUFS;
     }
+    lane.push_back(rq);
+    queued(lane.size());
+  }
+  if (_executor)
+    _executor->awake();
+  else
+    _condition.notify_one();
   return 0;
 };
 int Thread::awakeRequestableFromIsr(Requestable *rq) {
-  if (_workQueue)
-    if (xQueueSendFromISR(_workQueue, &rq, (TickType_t)0) != pdTRUE) {
-      //  WARN("queue overflow"); // cannot log here concurency issue
-    }
+  return awakeRequestable(rq);
 };
 
 void *Thread::id() { return _tcb; }
 
-void *Thread::currentId() { return pxCurrentTCB; }
+void *Thread::currentId() { return (void *)pthread_self(); }
 
-void Thread::run() { // FREERTOS block thread until awake or timer expired.
+// call with _mutex locked
+bool Thread::nextRequestable(Requestable *&prq) {
+  for (int lane = PRIO_LANES - 1; lane >= 0; lane--)
+    if (!_workQueue[lane].empty()) {
+      prq = _workQueue[lane].front();
+      _workQueue[lane].pop_front();
+      return true;
+    }
+  return false;
+}
+
+void Thread::start() {
+  _thread = std::thread([this]() { run(); });
+}
+
+bool Thread::hasWork() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (uint32_t lane = 0; lane < PRIO_LANES; lane++)
+    if (!_workQueue[lane].empty())
+      return true;
+  return false;
+}
+
+// same policy as FREERTOS
+uint64_t Thread::step(bool &more) {
+  uint64_t expTime = fireExpiredTimers(Sys::millis());
+  uint64_t start = Sys::micros();
+  uint64_t budgetEnd = start + _budget;
+  more = false;
+  while (true) {
+    Requestable *prq;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (!nextRequestable(prq))
+        return expTime;
+    }
+    prq->unschedule();
+    TRACE_ENTER(TRACE_REQUEST, prq);
+    prq->awake();
+    TRACE_EXIT(TRACE_REQUEST, prq);
+    uint64_t end = Sys::micros();
+    dispatched(start, end);
+    start = end;
+    if (end >= budgetEnd || Sys::millis() >= expTime) {
+      more = true;
+      return expTime;
+    }
+  }
+}
+
+void Thread::run() { // LINUX block thread until awake or next timer expiry
   _tcb = currentId();
   while (true) {
+    bool more;
+    uint64_t expTime = step(more);
+    if (more)
+      continue;
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_stop)
+      break;
+    bool empty = true;
+    for (uint32_t lane = 0; lane < PRIO_LANES; lane++)
+      empty = empty && _workQueue[lane].empty();
+    if (!empty)
+      continue; // queued while the batch ran
     uint64_t now = Sys::millis();
-    uint64_t expTime = now + 5000;
-    TimerSource *expiredTimer = 0;
-    // find next expired timer if any within 5 sec
-    for (auto timer : _timers) {
-      if (timer->expireTime() < expTime) {
-        expTime = timer->expireTime();
-        expiredTimer = timer;
-      }
-    }
+    uint64_t idleStart = Sys::micros();
+    if (expTime == UINT64_MAX)
+      _condition.wait(lock);
+    else if (expTime > now)
+      _condition.wait_for(lock, std::chrono::milliseconds(expTime - now));
+    idle(idleStart, Sys::micros());
+  }
+}
 
-    if (expiredTimer && (expTime <= now)) {
-      if (expiredTimer)
-        expiredTimer->request();
-    } else {
-      Requestable *prq;
-      uint32_t waitTime = pdMS_TO_TICKS(expTime - now) + 1;
-      if (waitTime < 0)
-        waitTime = 0;
-      uint32_t queueCounter = 0;
-      while (xQueueReceive(_workQueue, &prq, (TickType_t)waitTime) == pdTRUE) {
-        prq->request();
-        queueCounter++;
-        if (queueCounter > 10) {
-          WARN(" work queue > 10 ");
-          break;
-        }
-        waitTime == pdMS_TO_TICKS(expTime - Sys::millis());
-        if (waitTime > 0)
-          waitTime = 0;
-      }
-      if (expiredTimer) {
-        expiredTimer->request();
-      }
-    }
+void Executor::start(uint32_t stackSize, uint32_t priority) {
+  for (uint32_t worker = 0; worker < EXECUTOR_WORKERS; worker++)
+    _thread[worker] = std::thread(workerTask, this);
+}
+
+Executor::~Executor() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+    _wakeups += EXECUTOR_WORKERS;
   }
+  _condition.notify_all();
+  for (uint32_t worker = 0; worker < EXECUTOR_WORKERS; worker++)
+    if (_thread[worker].joinable())
+      _thread[worker].join();
 }
 
-#endif // FREERTOS
+void Executor::awake() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _wakeups++;
+  _condition.notify_one();
+}
+
+bool Executor::awakeFromIsr() {
+  awake();
+  return false;
+}
+
+// wakeups are counted so one given between the last scan and the wait is
+// not lost
+void Executor::wait(uint64_t expTime) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  auto woken = [this]() { return _wakeups > 0; };
+  uint64_t now = Sys::millis();
+  if (expTime == UINT64_MAX)
+    _condition.wait(lock, woken);
+  else if (expTime > now)
+    _condition.wait_for(lock, std::chrono::milliseconds(expTime - now), woken);
+  if (_wakeups)
+    _wakeups--;
+}
+
+// no non-volatile storage on the host, ConfigFlow keeps its default value
+void ConfigStore::init() {}
+bool ConfigStore::load(const char *name, void *value, uint32_t length) {
+  return false;
+}
+bool ConfigStore::save(const char *name, void *value, uint32_t length) {
+  return true;
+}
+bool ConfigStore::load(const char *name, std::string &value) { return false; }
+bool ConfigStore::save(const char *name, std::string &value) { return true; }
+
+#endif // LINUX
 
 #ifdef ESP32_IDF
 #include "esp_system.h"
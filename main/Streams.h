@@ -2,15 +2,23 @@
 #define STREAMS_H
 #include <ArduinoJson.h>
 #include <atomic>
+#include <cstddef>
+#include <cstdlib>
 #include <deque>
 #include <functional>
 #include <list>
+#include <new>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #ifdef ARDUINO
 
 #elif defined(__linux__)
 #define LINUX
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #else
 #define FREERTOS
 #include <FreeRTOS.h>
@@ -48,11 +56,23 @@ class Sys {
 #else
 #include <Log.h>
 #endif
+#include <Trace.h>
 //______________________________________________________________________________
 //
 template <class T> class Observer {
 	public:
 		virtual void onNext(const T &) = 0;
+		// a value nobody else uses, observers that keep it override this to
+		// move it instead of copying
+		virtual void onNext(T &&t) { onNext(static_cast<const T &>(t)); }
+		// number of values accepted now, producers that support backpressure
+		// don't emit when a downstream observer has no demand
+		virtual uint32_t demand() { return UINT32_MAX; }
+		// a block of values, operators that handle a block at once override it
+		virtual void onNextBatch(const T *values, size_t count) {
+			for (size_t i = 0; i < count; i++)
+				onNext(values[i]);
+		}
 };
 template <class IN> class Sink : public Observer<IN> {};
 //______________________________________________________________________________
@@ -61,36 +81,361 @@ template <class IN, class OUT> class Flow;
 //
 // DD : used vector of void pointers and not vector of pointers to template
 // class, to avoid explosion of vector implementations
+// work queue lane in the observer thread, PRIO_HIGH is always drained first
+typedef enum { PRIO_NORMAL = 0, PRIO_HIGH, PRIO_LANES } Priority;
+
 class Requestable {
+		std::atomic<bool> _scheduled; // sits in a Thread work queue
+		uint8_t _priority = PRIO_NORMAL;
+
 	public:
+		Requestable() : _scheduled(false) {}
+		Requestable(const Requestable &rq)
+			: _scheduled(false), _priority(rq._priority) {}
+		Requestable &operator=(const Requestable &) { return *this; }
 		virtual void request() = 0;
 		//{ WARN(" I am abstract Requestable. Don't call me."); };
+		// called by the Thread that was awakened for this requestable
+		virtual void awake() { request(); }
+		// false when request() would emit into a full downstream
+		virtual bool hasDemand() { return true; }
+		// true if not yet scheduled, a source is queued at most once
+		inline bool schedule() { return !_scheduled.exchange(true); }
+		inline void unschedule() { _scheduled = false; }
+		inline Priority priority() { return (Priority)_priority; }
+		void priority(Priority priority) { _priority = priority; }
 };
 //______________________________________________________________________________
 //
+// work queue depth, with coalescing it only needs one entry per source that
+// can be awakened from another thread
+#ifndef THREAD_QUEUE_DEPTH
+#define THREAD_QUEUE_DEPTH 20
+#endif
+// max time in usec spent on queued work before timers are checked again
+#ifndef THREAD_BUDGET_US
+#define THREAD_BUDGET_US 5000
+#endif
+// timer lateness histogram : bucket 0 on time, bucket i late less than 2^i
+// msec, last bucket everything later
+#ifndef THREAD_LATENESS_BUCKETS
+#define THREAD_LATENESS_BUCKETS 8
+#endif
+//______________________________________________________________________________
+//
+// Thread load counters, all counted since the previous Thread::stats() call
+//
+struct ThreadStats {
+		uint32_t dispatched;     // requestables awakened and timers fired
+		uint32_t queueHighWater; // most entries seen in a work queue lane
+		uint32_t overflows;      // awakes dropped on a full work queue
+		uint32_t lateness[THREAD_LATENESS_BUCKETS]; // timer fired - expired
+		uint32_t busyUs; // in request() and timer handlers
+		uint32_t idleUs; // blocked waiting for work or a timer
+		uint32_t longestRequestUs;
+};
+
 class TimerSource;
+class Executor;
 class Thread {
-		std::vector<TimerSource *> _timers;
+		friend class Executor;
+		std::vector<TimerSource *> _timers; // min-heap on expireTime()
+		std::vector<TimerSource *> _expired; // fired in deadline order
+		std::atomic<bool> _timersDirty{false};
 		std::vector<Requestable *> _requestables;
-		void *_tcb;
+		std::atomic<void *> _tcb; // task running this thread now
+		uint32_t _budget = THREAD_BUDGET_US;
+		Executor *_executor = 0;
+		std::atomic<bool> _claimed{false}; // by an Executor worker
+		std::atomic<uint32_t> _wakeup{UINT32_MAX}; // low 32 bits of msec
+		// stats, written by this thread except the queue counters
+		std::atomic<uint32_t> _dispatched;
+		std::atomic<uint32_t> _queueHighWater;
+		std::atomic<uint32_t> _overflows;
+		std::atomic<uint32_t> _lateness[THREAD_LATENESS_BUCKETS];
+		std::atomic<uint32_t> _busyUs;
+		std::atomic<uint32_t> _idleUs;
+		std::atomic<uint32_t> _longestRequestUs;
+		void queued(uint32_t entries);
+		void dispatched(uint64_t start, uint64_t end);
+		void idle(uint64_t start, uint64_t end);
 #ifdef FREERTOS
-		QueueHandle_t _workQueue = 0;
+		QueueHandle_t _workQueue[PRIO_LANES];
+#endif
+#ifdef LINUX
+		std::mutex _mutex;
+		std::condition_variable _condition;
+		std::deque<Requestable *> _workQueue[PRIO_LANES];
+		uint32_t _queueDepth; // per lane, as the FREERTOS queues
+		std::thread _thread;
+		bool _stop = false; // under _mutex
 #endif
+		bool nextRequestable(Requestable *&prq);
+		bool hasWork();
+		void reorderTimers(uint64_t now);
 
 	public:
 		void addTimer(TimerSource *ts);
 		void addRequestable(Requestable &rq);
-		Thread();
+		Thread(uint32_t queueDepth = THREAD_QUEUE_DEPTH);
 		int awakeRequestable(Requestable *rq);
 		int awakeRequestableFromIsr(Requestable *rq);
 		void run();
+#ifdef LINUX
+		void start(); // run() in its own std::thread
+		~Thread();    // stops and joins it
+#endif
 		TimerSource &operator|(TimerSource &ts);
 		void *id();
 		static void *currentId();
+		uint64_t fireExpiredTimers(uint64_t now);
+		// one pass of run() : expired timers, then queued work until the
+		// budget is spent, more is true when it returned for the budget
+		uint64_t step(bool &more);
+		void budget(uint32_t usec) { _budget = usec; }
+		void timersChanged() { _timersDirty = true; }
+		ThreadStats stats(); // read and restart counting
+		// msec until this thread needs the CPU, 0 with queued work,
+		// UINT32_MAX when it only waits for events
+		uint32_t wakeupIn();
+};
+//______________________________________________________________________________
+//
+// Executor : pool of worker tasks, one per core, shared by several Threads.
+// A pooled Thread has no task of its own, whichever worker is idle takes
+// over a pooled Thread with queued work or expired timers, so load moves to
+// the core with time left. A Thread runs on one worker at a time : its
+// sources keep their order and are never re-entered.
+// Threads that need a fixed core or strict timing stay out of the pool and
+// run() on their own pinned task.
+//
+//	executor.add(mqttThread);
+//	executor.add(servoThread);
+//	executor.start(20000, 17);
+//
+#ifndef EXECUTOR_WORKERS
+#define EXECUTOR_WORKERS 2
+#endif
+#if defined(FREERTOS) || defined(LINUX)
+class Executor {
+		std::vector<Thread *> _threads;
+		std::atomic<uint32_t> _idle;    // bit per worker waiting for work
+		std::atomic<uint32_t> _started; // workers running
+		void *_workers[EXECUTOR_WORKERS];
+#ifdef LINUX
+		std::mutex _mutex;
+		std::condition_variable _condition;
+		uint32_t _wakeups = 0;
+		std::thread _thread[EXECUTOR_WORKERS];
+#endif
+		std::atomic<bool> _stop{false};
+		static void workerTask(void *pv);
+		void work(uint32_t worker);
+		void wait(uint64_t expTime);
+
+	public:
+		Executor();
+#ifdef LINUX
+		~Executor(); // stops and joins the workers
+#endif
+		void add(Thread &thread); // before start()
+		void start(uint32_t stackSize, uint32_t priority);
+		void awake();
+		bool awakeFromIsr(); // true when a higher priority task was woken
 };
+#endif
+//______________________________________________________________________________
+//
+// Lock-free bounded ring buffer, no locks so usable from ISR
+// a single consumer pops, producers can be threads or ISR ( each slot carries
+// a sequence number so a producer interrupted by an ISR doesn't corrupt the
+// buffer ). When full the newest value is dropped and counted.
+// size : power of 2
+//
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+template <class T> class RingBuffer {
+	public:
+		struct Slot {
+			std::atomic<uint32_t> sequence;
+			T value;
+		};
+
+	private:
+		// padding keeps head and tail on different cache lines, also on heap
+		std::atomic<uint32_t> _head; // producers
+		uint8_t _padHead[CACHE_LINE_SIZE - sizeof(std::atomic<uint32_t>)];
+		std::atomic<uint32_t> _tail; // consumer
+		uint8_t _padTail[CACHE_LINE_SIZE - sizeof(std::atomic<uint32_t>)];
+		std::atomic<uint32_t> _overflows;
+		Slot *_slots;
+		uint32_t _mask;
+
+	public:
+		// slots are indexed with a mask, only the largest power of 2 not
+		// above size is used
+		RingBuffer(Slot *slots, uint32_t size)
+			: _head(0), _tail(0), _overflows(0), _slots(slots), _mask(size - 1) {
+			while (size & _mask) // clear low bits until a power of 2 is left
+				_mask = (size &= _mask) - 1;
+			for (uint32_t i = 0; i < size; i++)
+				_slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		template <class V> bool push(V &&t) {
+			uint32_t pos = _head.load(std::memory_order_relaxed);
+			while (true) {
+				Slot &slot = _slots[pos & _mask];
+				int32_t diff =
+				    (int32_t)(slot.sequence.load(std::memory_order_acquire) - pos);
+				if (diff == 0) {
+					if (_head.compare_exchange_weak(pos, pos + 1,
+					                                std::memory_order_relaxed))
+						break;
+				} else if (diff < 0) {
+					_overflows++;
+					return false;
+				} else {
+					pos = _head.load(std::memory_order_relaxed);
+				}
+			}
+			Slot &slot = _slots[pos & _mask];
+			slot.value = std::forward<V>(t);
+			slot.sequence.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+		bool pop(T &t) {
+			uint32_t pos = _tail.load(std::memory_order_relaxed);
+			Slot &slot = _slots[pos & _mask];
+			if (slot.sequence.load(std::memory_order_acquire) != pos + 1)
+				return false; // empty or producer still writing
+			t = std::move(slot.value);
+			slot.value = T(); // a pooled buffer goes back now, not on overwrite
+			slot.sequence.store(pos + _mask + 1, std::memory_order_release);
+			_tail.store(pos + 1, std::memory_order_relaxed);
+			return true;
+		}
+		uint32_t overflows() { return _overflows; }
+		uint32_t size() { return _head - _tail; } // approximate
+		uint32_t capacity() { return _mask + 1; }
+};
+//______________________________________________________________________________
+//
+// Arena : bump pointer allocator for the stream topology built at startup.
+// Nodes live forever, so they are never freed. After seal() or when full,
+// allocations fall back to the heap and are counted in overflow().
+//
+#ifndef TOPOLOGY_ARENA_SIZE
+#define TOPOLOGY_ARENA_SIZE 8192
+#endif
+class Arena {
+		uint8_t *_buffer;
+		uint32_t _size;
+		uint32_t _used;
+		uint32_t _overflow;
+		bool _sealed;
+
+	public:
+		constexpr Arena(uint8_t *buffer, uint32_t size)
+			: _buffer(buffer), _size(size), _used(0), _overflow(0), _sealed(false) {}
+		void *allocate(size_t size, size_t align);
+		template <class T, class... Args> T &make(Args &&... args) {
+			return *new (allocate(sizeof(T), alignof(T)))
+			       T(std::forward<Args>(args)...);
+		}
+		void seal() { _sealed = true; }
+		uint32_t used() { return _used; }
+		uint32_t size() { return _size; }
+		uint32_t overflow() { return _overflow; }
+};
+extern Arena topology;
+//______________________________________________________________________________
+//
+// ObserverList : first N observers are stored inline, only more spill to the
+// heap. Most sources have 1 or 2 observers.
+//
+#ifndef SOURCE_INLINE_OBSERVERS
+#define SOURCE_INLINE_OBSERVERS 2
+#endif
+// max values passed in one onNextBatch() by operators that collect a block
+#ifndef EMIT_BATCH
+#define EMIT_BATCH 16
+#endif
+template <uint32_t N> class ObserverList {
+		void *_inline[N];
+		void **_items;
+		uint32_t _size;
+		uint32_t _capacity;
+
+		void grow() {
+			void **items = new void *[_capacity * 2];
+			for (uint32_t i = 0; i < _size; i++)
+				items[i] = _items[i];
+			if (_items != _inline)
+				delete[] _items;
+			_items = items;
+			_capacity *= 2;
+		}
+
+	public:
+		ObserverList() : _items(_inline), _size(0), _capacity(N) {}
+		ObserverList(const ObserverList &other)
+			: _items(_inline), _size(0), _capacity(N) {
+			for (void *pv : other)
+				push_back(pv);
+		}
+		ObserverList &operator=(const ObserverList &other) {
+			if (this != &other) {
+				_size = 0;
+				for (void *pv : other)
+					push_back(pv);
+			}
+			return *this;
+		}
+		~ObserverList() {
+			if (_items != _inline)
+				delete[] _items;
+		}
+		inline void push_back(void *pv) {
+			if (_size == _capacity)
+				grow();
+			_items[_size++] = pv;
+		}
+		inline uint32_t size() const { return _size; }
+		inline void *operator[](uint32_t idx) const { return _items[idx]; }
+		inline void *const *begin() const { return _items; }
+		inline void *const *end() const { return _items + _size; }
+};
+//______________________________________________________________________________
+//
+// DemandVisit : sources whose demand the current thread is computing, kept on
+// its stack, a == b binds flows in a cycle
+//
+struct DemandVisit {
+		const void *source;
+		DemandVisit *next;
+		static thread_local DemandVisit *chain;
+};
+//______________________________________________________________________________
+//
 // not sure these extra inheritance are useful
 template <class T> class Source : public Requestable {
-		std::vector<void *> _observers;
+		ObserverList<SOURCE_INLINE_OBSERVERS> _observers;
+		RingBuffer<T> *_mailbox = 0;
+
+		void deliver(T &&t) {
+			uint32_t count = _observers.size();
+			for (uint32_t i = 0; i < count; i++) {
+				Observer<T> *pObserver = static_cast<Observer<T> *>(_observers[i]);
+				TRACE_ENTER(TRACE_ONNEXT, pObserver);
+				if (i + 1 < count)
+					pObserver->onNext(static_cast<const T &>(t));
+				else
+					pObserver->onNext(std::move(t));
+				TRACE_EXIT(TRACE_ONNEXT, pObserver);
+			}
+		}
 
 	protected:
 		uint32_t size() { return _observers.size(); }
@@ -103,22 +448,122 @@ template <class T> class Source : public Requestable {
 		virtual void subscribe(Observer<T> &observer) {
 			_observers.push_back((void *)&observer);
 		}
+		// lowest demand of all observers, a cycle back to this source adds no
+		// limit
+		uint32_t downstreamDemand() {
+			for (DemandVisit *visit = DemandVisit::chain; visit; visit = visit->next)
+				if (visit->source == this)
+					return UINT32_MAX;
+			DemandVisit visit = {this, DemandVisit::chain};
+			DemandVisit::chain = &visit; // per thread, pollers run on several
+			uint32_t demand = UINT32_MAX;
+			for (void *pv : _observers) {
+				uint32_t d = static_cast<Observer<T> *>(pv)->demand();
+				if (d < demand)
+					demand = d;
+			}
+			DemandVisit::chain = visit.next;
+			return demand;
+		}
+		bool hasDemand() { return downstreamDemand() > 0; }
 
 		void emit(const T &t) {
 			if ((_observerThread == 0) ||
 			        (_observerThread && _observerThread->id() == Thread::currentId()))
 				for (void *pv : _observers) {
 					Observer<T> *pObserver = static_cast<Observer<T> *>(pv);
+					TRACE_ENTER(TRACE_ONNEXT, pObserver);
 					pObserver->onNext(t);
-				} else
+					TRACE_EXIT(TRACE_ONNEXT, pObserver);
+				} else if (_mailbox == 0 || _mailbox->push(t))
+				_observerThread->awakeRequestable(this);
+		}
+		// observers but the last get a copy, the last one gets the value moved
+		void emit(T &&t) {
+			if ((_observerThread == 0) ||
+			        (_observerThread && _observerThread->id() == Thread::currentId()))
+				deliver(std::move(t));
+			else if (_mailbox == 0 || _mailbox->push(std::move(t)))
 				_observerThread->awakeRequestable(this);
 		}
-		Source<T> &observeOn(Thread &thread) {
+		// a block goes to each observer in one onNextBatch() call, across
+		// threads value by value like emit()
+		void emitBatch(const T *values, size_t count) {
+			if (count == 0)
+				return;
+			if ((_observerThread == 0) ||
+			        (_observerThread && _observerThread->id() == Thread::currentId()))
+				for (void *pv : _observers) {
+					TRACE_ENTER(TRACE_ONNEXT, pv);
+					static_cast<Observer<T> *>(pv)->onNextBatch(values, count);
+					TRACE_EXIT(TRACE_ONNEXT, pv);
+				}
+			else
+				for (size_t i = 0; i < count; i++)
+					emit(values[i]);
+		}
+		// ATTENTION !! no logging from Isr, requires a mailbox to pass the value
+		void emitFromIsr(const T &t) {
+			if (_mailbox && _observerThread && _mailbox->push(t))
+				_observerThread->awakeRequestableFromIsr(this);
+		}
+		// deliver values emitted from other threads on the observer thread
+		void awake() {
+			if (_mailbox == 0) {
+				this->request();
+				return;
+			}
+			T t;
+			while (_mailbox->pop(t))
+				deliver(std::move(t));
+		}
+		Source<T> &observeOn(Thread &thread, Priority priority = PRIO_NORMAL) {
 			_observerThread = &thread;
+			this->priority(priority);
+			return *this;
+		}
+		// cross thread emits pass the value through a mailbox of depth slots
+		// ( rounded up to a power of 2 ) instead of a request() on the observer
+		// thread. Allocated once at setup from the topology arena.
+		Source<T> &mailbox(uint32_t depth) {
+			typedef typename RingBuffer<T>::Slot Slot;
+			if (_mailbox == 0) {
+				uint32_t size = 1;
+				while (size < depth)
+					size <<= 1;
+				depth = size;
+				Slot *slots = (Slot *)topology.allocate(sizeof(Slot) * depth, alignof(Slot));
+				for (uint32_t i = 0; i < depth; i++)
+					new (&slots[i]) Slot();
+				_mailbox = &topology.make<RingBuffer<T>>(slots, depth);
+			}
 			return *this;
 		}
 		Thread *observerThread() { return _observerThread; }
 };
+//______________________________________________________________________________
+//
+// BatchEmitter : collects the output of a block, emits EMIT_BATCH at a time
+// and the rest when it goes out of scope
+//
+template <class T> class BatchEmitter {
+		Source<T> &_source;
+		T _values[EMIT_BATCH];
+		size_t _count = 0;
+
+	public:
+		BatchEmitter(Source<T> &source) : _source(source) {}
+		~BatchEmitter() { flush(); }
+		template <class V> void add(V &&t) {
+			_values[_count++] = std::forward<V>(t);
+			if (_count == EMIT_BATCH)
+				flush();
+		}
+		void flush() {
+			_source.emitBatch(_values, _count);
+			_count = 0;
+		}
+};
 
 // A flow can be both Sink and Source. Most of the time it will be in the middle
 // of a stream
@@ -129,6 +574,8 @@ class Flow : public Sink<IN>, public Source<OUT> {
 	public:
 		Flow() {};
 		Flow<IN, OUT>(Sink<IN> &a, Source<OUT> &b) : Sink<IN>(a), Source<OUT>(b) {};
+		// a flow passes the demand of its observers upstream
+		uint32_t demand() { return this->downstreamDemand(); }
 };
 //_________________________________________CompositeFlow_______________________________
 //
@@ -142,15 +589,20 @@ class CompositeFlow : public Flow<IN, OUT> {
 			: Flow<IN, OUT>(a, b), _in(a), _out(b) {};
 		void request() { _in.request(); };
 		void onNext(const IN &in) { _in.onNext(in); }
+		void onNext(IN &&in) { _in.onNext(std::move(in)); }
+		void onNextBatch(const IN *values, size_t count) {
+			_in.onNextBatch(values, count);
+		}
+		uint32_t demand() { return _in.demand(); }
 		void subscribe(Observer<OUT> &observer) { _out.subscribe(observer); }
 };
 //______________________________________________________________________________________
 //
 template <class IN, class INTERM, class OUT>
 Flow<IN, OUT> &operator>>(Flow<IN, INTERM> &flow1, Flow<INTERM, OUT> &flow2) {
-	Flow<IN, OUT> *cflow = new CompositeFlow<IN, INTERM, OUT>(flow1, flow2);
+	Flow<IN, OUT> &cflow = topology.make<CompositeFlow<IN, INTERM, OUT>>(flow1, flow2);
 	flow1.subscribe(flow2);
-	return *cflow;
+	return cflow;
 };
 
 template <class IN, class OUT>
@@ -197,43 +649,127 @@ template <class T> class ValueFlow : public Flow<T, T> {
 			}
 			_value = value;
 		}
+		// same order as above, observers still see the previous value()
+		void onNext(T &&value) {
+			if (_emitOnChange)
+				this->emit(static_cast<const T &>(value));
+			_value = std::move(value);
+		}
 		void emitOnChange(bool b) { _emitOnChange = b; };
-		inline void operator=(T value) { onNext(value); };
+		inline void operator=(T value) { onNext(std::move(value)); };
 		inline T operator()() { return _value; }
 };
 //______________________________________________________________________________
 //
+// InlineFunction : callable stored in a fixed inline buffer, never allocates
+// a capture that doesn't fit SIZE bytes is a compile error
+//
+#ifndef INLINE_FUNCTION_SIZE
+#define INLINE_FUNCTION_SIZE (4 * sizeof(void *))
+#endif
+template <class Signature, size_t SIZE = INLINE_FUNCTION_SIZE>
+class InlineFunction;
+
+template <class R, class... Args, size_t SIZE>
+class InlineFunction<R(Args...), SIZE> {
+		typename std::aligned_storage<SIZE>::type _storage;
+		R (*_invoke)(const void *, Args...) = 0;
+		void (*_manage)(void *, const void *) = 0; // copy from src or destroy
+
+		template <class F> static R invoke(const void *f, Args... args) {
+			return (*(F *)f)(std::forward<Args>(args)...);
+		}
+		template <class F> static void manage(void *dst, const void *src) {
+			if (src)
+				new (dst) F(*(const F *)src);
+			else
+				((F *)dst)->~F();
+		}
+		template <class F> void assign(const F &f) {
+			static_assert(sizeof(F) <= SIZE,
+			              "capture too large for InlineFunction, increase SIZE");
+			static_assert(alignof(F) <= alignof(decltype(_storage)),
+			              "capture alignment too large for InlineFunction");
+			new (&_storage) F(f);
+			_invoke = invoke<F>;
+			_manage = manage<F>;
+		}
+		void copy(const InlineFunction &other) {
+			if (other._manage)
+				other._manage(&_storage, &other._storage);
+			_invoke = other._invoke;
+			_manage = other._manage;
+		}
+		void reset() {
+			if (_manage)
+				_manage(&_storage, 0);
+			_invoke = 0;
+			_manage = 0;
+		}
+
+	public:
+		InlineFunction() {}
+		template <class F, class = typename std::enable_if<!std::is_same<
+		                       typename std::decay<F>::type, InlineFunction>::value>::type>
+		InlineFunction(const F &f) {
+			assign(f);
+		}
+		InlineFunction(const InlineFunction &other) { copy(other); }
+		~InlineFunction() { reset(); }
+		InlineFunction &operator=(const InlineFunction &other) {
+			if (this != &other) {
+				reset();
+				copy(other);
+			}
+			return *this;
+		}
+		inline R operator()(Args... args) const {
+			return _invoke(&_storage, std::forward<Args>(args)...);
+		}
+		explicit operator bool() const { return _invoke != 0; }
+};
+//______________________________________________________________________________
+//
 template <class T> class LambdaSink : public Sink<T> {
-		std::function<void(T)> _handler;
+		InlineFunction<void(const T &)> _handler;
 
 	public:
 		LambdaSink() {};
-		LambdaSink(std::function<void(T)> handler) : _handler(handler) {};
-		void handler(std::function<void(T)> handler) { _handler = handler; };
+		template <class F> LambdaSink(const F &handler) : _handler(handler) {};
+		template <class F> void handler(const F &handler) { _handler = handler; };
 		void onNext(const T &event) { _handler(event); };
 };
 //________________________________________________________________________
 //
 template <class T> class LambdaSource : public Source<T> {
-		std::function<T()> _handler;
+		InlineFunction<T()> _handler;
 
 	public:
-		LambdaSource(std::function<T()> handler) : _handler(handler) {};
+		template <class F> LambdaSource(const F &handler) : _handler(handler) {};
 		void request() { this->emit(_handler()); }
 };
 //______________________________________________________________________________
 //
+// ThreadStatsSource : load counters of a thread, poll it to publish them
+//	mqttThread | slowPoller(topology.make<ThreadStatsSource>(motorThread));
+//
+class ThreadStatsSource : public Source<ThreadStats> {
+		Thread &_thread;
+
+	public:
+		ThreadStatsSource(Thread &thread) : _thread(thread) {}
+		void request() { this->emit(_thread.stats()); }
+};
+//______________________________________________________________________________
+//
 template <class IN, class OUT> class LambdaFlow : public Flow<IN, OUT> {
-		std::function<OUT(IN)> _handler;
+		InlineFunction<OUT(const IN &)> _handler;
 
 	public:
 		LambdaFlow() {};
-		LambdaFlow(std::function<OUT(IN)> handler) : _handler(handler) {};
-		void handler(std::function<OUT(IN)> handler) { _handler = handler; };
-		void onNext(const IN &event) {
-			OUT out = _handler(event);
-			this->emit(out);
-		};
+		template <class F> LambdaFlow(const F &handler) : _handler(handler) {};
+		template <class F> void handler(const F &handler) { _handler = handler; };
+		void onNext(const IN &event) { this->emit(_handler(event)); };
 		void request() {};
 };
 //__________________________________________________________________________`
@@ -272,6 +808,14 @@ template <class T, int x> class Median : public Flow<T, T> {
 				this->emit(_mf.getMedian());
 			}
 		};
+		void onNextBatch(const T *values, size_t count) {
+			BatchEmitter<T> out(*this);
+			for (size_t i = 0; i < count; i++) {
+				_mf.addSample(values[i]);
+				if (_mf.isReady())
+					out.add(_mf.getMedian());
+			}
+		}
 		void request() { this->emit(_mf.getMedian()); }
 };
 
@@ -336,28 +880,99 @@ template <class T> class Throttle : public Flow<T, T> {
 			}
 			_lastValue = value;
 		}
+		// one clock read per block, at most the first value passes
+		void onNextBatch(const T *values, size_t count) {
+			if (count == 0)
+				return;
+			uint64_t now = Sys::millis();
+			if (now > _nextEmit) {
+				this->emit(values[0]);
+				_nextEmit = now + _delta;
+			}
+			_lastValue = values[count - 1];
+		}
 		void request() { this->emit(_lastValue); };
 };
 //__________________________________________________________________________`
 //
+// ChangeFlow : emits only when value moved more than delta from the last one
+//
+template <class T> class ChangeFlow : public Flow<T, T> {
+		T _value;
+		int _delta;
+		bool _emitOnChange = true;
+
+	public:
+		ChangeFlow(int delta) : _value() { _delta = delta; }
+		void request() { this->emit(_value); }
+		void onNext(const T &value) {
+			if (_emitOnChange && abs(value - _value) > _delta) {
+				this->emit(value);
+			}
+			_value = value;
+		}
+		void emitOnChange(bool b) { _emitOnChange = b; };
+		inline void operator=(T value) { onNext(value); };
+		inline T operator()() { return _value; }
+};
+//__________________________________________________________________________`
+//
 // TimerSource
 // id : the timer id send with the timer expiration
 // interval : time after which the timer expires
 // repeat : repetitive timer
 //
 // run : sink bool to stop or run timer
-//	start : restart timer from now+interval
+//	start : restart timer from now+interval, safe from an ISR or another
+//	thread : once in a Thread the new expiry is applied by that thread
+// deadline : msec after expiry the handler must have run, default interval.
+//	Expired timers of a Thread fire earliest deadline first.
+// slack : msec the timer may fire late, so the Thread wakes once for timers
+//	expiring close together
+// overrun : what a timer does when it fires a period or more too late
+//	OVERRUN_CATCHUP fires back to back for each missed period
+//	OVERRUN_SKIP drops the missed periods and stays on its period grid
+//	OVERRUN_COALESCE fires once and restarts the period from now
 //__________________________________________________________________________
 class TimerMsg {
 	public:
 		uint32_t id;
 };
 
+typedef enum { OVERRUN_CATCHUP = 0, OVERRUN_SKIP, OVERRUN_COALESCE } Overrun;
+
+// PendingExpire : expiry posted by start(), low 32 bits of msec. A copy
+// starts without one.
+class PendingExpire {
+		std::atomic<uint32_t> _expire{0};
+		std::atomic<bool> _posted{false};
+
+	public:
+		PendingExpire() {}
+		PendingExpire(const PendingExpire &) {}
+		void post(uint32_t expire) {
+			_expire.store(expire, std::memory_order_relaxed);
+			_posted.store(true, std::memory_order_release);
+		}
+		bool take(uint32_t &expire) {
+			if (!_posted.exchange(false, std::memory_order_acquire))
+				return false;
+			expire = _expire.load(std::memory_order_relaxed);
+			return true;
+		}
+};
+
 class TimerSource : public Source<TimerMsg> {
 		uint32_t _interval;
 		bool _repeat;
-		uint64_t _expireTime;
+		uint64_t _expireTime; // only written by the owning Thread
+		PendingExpire _pending;
 		uint32_t _id;
+		Thread *_thread = 0;
+		uint32_t _deadline = 0; // 0 : same as interval
+		uint8_t _overrun = OVERRUN_CATCHUP;
+		uint32_t _overruns = 0;
+		uint32_t _slack = 0;
 
 	public:
 		ValueFlow<bool> running = true;
@@ -368,26 +983,61 @@ class TimerSource : public Source<TimerMsg> {
 			start();
 		}
 		void start() {
-			running = true;
-			_expireTime = Sys::millis() + _interval;
+			if (!running()) // no emit or write on every restart
+				running = true;
+			uint64_t expire = Sys::millis() + _interval;
+			if (_thread) { // the heap may be sifting on _expireTime right now
+				_pending.post((uint32_t)expire);
+				_thread->timersChanged();
+			} else
+				_expireTime = expire;
+		}
+		// on the owning Thread, true when start() posted a new expiry
+		bool applyStart(uint64_t now) {
+			uint32_t expire;
+			if (!_pending.take(expire))
+				return false;
+			_expireTime = now + (int32_t)(expire - (uint32_t)now);
+			return true;
 		}
 		void stop() { running = false; }
 		void interval(uint32_t i) { _interval = i; }
 		void request() {
 			//       INFO("[%X] %d request() ",this,_id);
 			if (running()) {
-				if (Sys::millis() >= _expireTime) {
+				uint64_t now = Sys::millis();
+				if (now >= _expireTime) {
 					//                INFO("[%X]:%d:%llu timer emit
 					//                ",this,interval(),expireTime());
+					if (now > deadlineTime())
+						_overruns++;
 					_expireTime += _interval;
+					if (_expireTime <= now && _overrun != OVERRUN_CATCHUP) {
+						if (_overrun == OVERRUN_SKIP && _interval) // keep period grid
+							_expireTime += ((now - _expireTime) / _interval + 1) * _interval;
+						else
+							_expireTime = now + _interval;
+					}
 					this->emit({_id});
 				}
 			} else {
-				WARN(" timer not running ");
+				_expireTime = Sys::millis() + _interval; // idle until started
 			}
 		}
 		uint64_t expireTime() { return _expireTime; }
+		uint64_t deadlineTime() {
+			return _expireTime + (_deadline ? _deadline : _interval);
+		}
+		void deadline(uint32_t msec) { _deadline = msec; }
+		void slack(uint32_t msec) { _slack = msec; }
+		uint64_t latestTime() { return _expireTime + _slack; }
+		void overrun(Overrun policy) { _overrun = policy; }
+		uint32_t overruns() { return _overruns; } // fired after deadline
+		Thread *thread() { return _thread; }
+		void thread(Thread *thread) { _thread = thread; }
 		inline uint32_t interval() { return _interval; }
+		uint32_t id() { return _id; }
+		void id(uint32_t id) { _id = id; }
 		void subscribeOn(Thread &thread) { thread.addTimer(this); }
 		void observeOn(Thread &thread) { thread.addTimer(this); }
 };
@@ -421,6 +1071,8 @@ template <class T> class AsyncValueFlow : public Flow<T, T> {
 template <class T> class AsyncFlow : public Flow<T, T> {
 		std::deque<T> _buffer;
 		uint32_t _queueDepth;
+		bool _backpressure = false;
+		std::atomic<uint32_t> _overflows{0};
 		SemaphoreHandle_t xSemaphore = NULL;
 
 	public:
@@ -428,17 +1080,24 @@ template <class T> class AsyncFlow : public Flow<T, T> {
 		AsyncFlow(uint32_t size) : _queueDepth(size) {
 			xSemaphore = xSemaphoreCreateBinary();
 			xSemaphoreGive(xSemaphore);
-			fromIsr.handler([&](T value) { onNextFromIsr(value); });
+			fromIsr.handler([&](const T &value) { onNextFromIsr(value); });
 		}
-		void onNext(const T &event) {
+		void onNext(const T &event) { store(event); }
+		void onNext(T &&event) { store(std::move(event)); }
+		template <class V> void store(V &&event) {
 			if (xSemaphoreTake(xSemaphore, (TickType_t)10) == pdTRUE) {
 				if (_buffer.size() >= _queueDepth) {
+					_overflows++; // rejected or oldest dropped
+					if (_backpressure) { // producer ignored demand()
+						xSemaphoreGive(xSemaphore);
+						return;
+					}
 					_buffer.pop_front();
 					//					WARN(" buffer overflow in
 					// BufferedSink
 					//");
 				}
-				_buffer.push_back(event);
+				_buffer.push_back(std::forward<V>(event));
 				xSemaphoreGive(xSemaphore);
 				if (this->observerThread())
 					this->observerThread()->awakeRequestable(this);
@@ -447,10 +1106,15 @@ template <class T> class AsyncFlow : public Flow<T, T> {
 				WARN(" timeout on async buffer ! ");
 			}
 		}
-		void onNextFromIsr(T &event) { // ATTENTION !! no logging from Isr
+		void onNextFromIsr(const T &event) { // ATTENTION !! no logging from Isr
 			BaseType_t higherPriorityTaskWoken;
 			if (xSemaphoreTakeFromISR(xSemaphore, &higherPriorityTaskWoken) == pdTRUE) {
 				if (_buffer.size() >= _queueDepth) {
+					_overflows++; // rejected or oldest dropped
+					if (_backpressure) {
+						xSemaphoreGiveFromISR(xSemaphore, &higherPriorityTaskWoken);
+						return;
+					}
 					_buffer.pop_front();
 					//					WARN(" buffer overflow in
 					// BufferedSink
@@ -466,26 +1130,99 @@ template <class T> class AsyncFlow : public Flow<T, T> {
 			}
 		}
 
+		// drains in blocks of EMIT_BATCH, one semaphore take per block
 		void request() {
+			T block[EMIT_BATCH];
 			while (true) {
-				bool hasData = false;
+				size_t count = 0;
 				if (xSemaphoreTake(xSemaphore, (TickType_t)10) == pdTRUE) {
-					T t;
-					if (_buffer.size()) {
-						t = _buffer.front();
+					while (count < EMIT_BATCH && _buffer.size()) {
+						block[count++] = std::move(_buffer.front());
 						_buffer.pop_front();
-						hasData = true;
 					}
 					xSemaphoreGive(xSemaphore);
-					if (hasData)
-						this->emit(t);
+					this->emitBatch(block, count);
 				} else {
 					WARN(" timeout on async buffer ! ");
 				}
-				if (!hasData)
+				if (count < EMIT_BATCH)
+					break;
+			}
+		}
+		// when set a full buffer rejects new values instead of dropping the
+		// oldest, and demand() tells producers how many values still fit
+		void backpressure(bool b) { _backpressure = b; }
+		uint32_t overflows() { return _overflows; } // values lost on a full buffer
+		uint32_t demand() {
+			if (!_backpressure)
+				return UINT32_MAX;
+			uint32_t free = 0;
+			if (xSemaphoreTake(xSemaphore, (TickType_t)10) == pdTRUE) {
+				free = _queueDepth - _buffer.size();
+				xSemaphoreGive(xSemaphore);
+			}
+			return free;
+		}
+};
+#endif
+
+#ifdef LINUX
+
+template <class T> class AsyncFlow : public Flow<T, T> {
+		std::deque<T> _buffer;
+		uint32_t _queueDepth;
+		bool _backpressure = false;
+		std::atomic<uint32_t> _overflows{0};
+		std::mutex _mutex;
+
+	public:
+		LambdaSink<T> fromIsr;
+		AsyncFlow(uint32_t size) : _queueDepth(size) {
+			fromIsr.handler([&](const T &value) { onNextFromIsr(value); });
+		}
+		void onNext(const T &event) { store(event); }
+		void onNext(T &&event) { store(std::move(event)); }
+		template <class V> void store(V &&event) {
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (_buffer.size() >= _queueDepth) {
+					_overflows++; // rejected or oldest dropped
+					if (_backpressure)
+						return;
+					_buffer.pop_front();
+				}
+				_buffer.push_back(std::forward<V>(event));
+			}
+			if (this->observerThread())
+				this->observerThread()->awakeRequestable(this);
+		}
+		void onNextFromIsr(const T &event) { onNext(event); } // no ISR on host
+
+		// drains in blocks of EMIT_BATCH, one lock per block
+		void request() {
+			T block[EMIT_BATCH];
+			while (true) {
+				size_t count = 0;
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					while (count < EMIT_BATCH && _buffer.size()) {
+						block[count++] = std::move(_buffer.front());
+						_buffer.pop_front();
+					}
+				}
+				this->emitBatch(block, count);
+				if (count < EMIT_BATCH)
 					break;
 			}
 		}
+		void backpressure(bool b) { _backpressure = b; }
+		uint32_t overflows() { return _overflows; } // values lost on a full buffer
+		uint32_t demand() {
+			if (!_backpressure)
+				return UINT32_MAX;
+			std::lock_guard<std::mutex> lock(_mutex);
+			return _queueDepth - _buffer.size();
+		}
 };
 #endif
 
@@ -494,26 +1231,38 @@ template <class T> class AsyncFlow : public Flow<T, T> {
 template <class T> class AsyncFlow : public Flow<T, T> {
 		std::deque<T> _buffer;
 		uint32_t _queueDepth;
+		bool _backpressure = false;
+		std::atomic<uint32_t> _overflows{0};
 
 	public:
 		LambdaSink<T> fromIsr;
 
 		AsyncFlow(uint32_t size) : _queueDepth(size) {
-			fromIsr.handler([&](T value) { onNextFromIsr(value); });
+			fromIsr.handler([&](const T &value) { onNextFromIsr(value); });
 		}
-		void onNext(const T &event) {
+		void onNext(const T &event) { store(event); }
+		void onNext(T &&event) { store(std::move(event)); }
+		template <class V> void store(V &&event) {
 			noInterrupts();
 			if (_buffer.size() >= _queueDepth) {
+				_overflows++; // rejected or oldest dropped
+				if (_backpressure) {
+					interrupts();
+					return;
+				}
 				_buffer.pop_front();
 				//					WARN(" buffer overflow in
 				// BufferedSink ");
 			}
-			_buffer.push_back(event);
+			_buffer.push_back(std::forward<V>(event));
 			interrupts();
 		}
 
-		void onNextFromIsr(T &event) {
+		void onNextFromIsr(const T &event) {
 			if (_buffer.size() >= _queueDepth) {
+				_overflows++; // rejected or oldest dropped
+				if (_backpressure)
+					return;
 				_buffer.pop_front();
 			}
 			_buffer.push_back(event);
@@ -524,18 +1273,70 @@ template <class T> class AsyncFlow : public Flow<T, T> {
 			T t;
 			bool hasData = false;
 			if (_buffer.size()) {
-				t = _buffer.front();
+				t = std::move(_buffer.front());
 				_buffer.pop_front();
 				hasData = true;
 			}
 			if (hasData)
-				this->emit(t);
+				this->emit(std::move(t));
 			interrupts();
 		}
+		void backpressure(bool b) { _backpressure = b; }
+		uint32_t overflows() { return _overflows; } // values lost on a full buffer
+		uint32_t demand() {
+			return _backpressure ? _queueDepth - _buffer.size() : UINT32_MAX;
+		}
 };
 #endif
 //__________________________________________________________________________`
 //
+// Lock-free ring buffer flow , to connect an ISR or thread to another thread
+// SIZE : fixed number of slots, power of 2, no heap used
+// a single consumer thread drains, producers can be threads or ISR ( each
+// slot carries a sequence number so a producer interrupted by an ISR doesn't
+// corrupt the buffer ). When full the newest value is dropped and counted.
+// With backpressure(true) upstream sees the free slots as demand.
+//
+//__________________________________________________________________________
+template <class T, uint32_t SIZE> class AsyncRingFlow : public Flow<T, T> {
+		static_assert(SIZE > 1 && (SIZE & (SIZE - 1)) == 0,
+		              "AsyncRingFlow SIZE must be a power of 2");
+		typename RingBuffer<T>::Slot _slots[SIZE];
+		RingBuffer<T> _ring;
+		bool _backpressure = false;
+
+	public:
+		LambdaSink<T> fromIsr;
+		AsyncRingFlow() : _ring(_slots, SIZE) {
+			fromIsr.handler([&](const T &value) { onNextFromIsr(value); });
+		}
+		void onNext(const T &event) {
+			if (_ring.push(event) && this->observerThread())
+				this->observerThread()->awakeRequestable(this);
+		}
+		void onNextFromIsr(const T &event) { // ATTENTION !! no logging from Isr
+			if (_ring.push(event) && this->observerThread())
+				this->observerThread()->awakeRequestableFromIsr(this);
+		}
+		void request() {
+			T block[EMIT_BATCH];
+			size_t count;
+			do {
+				for (count = 0; count < EMIT_BATCH && _ring.pop(block[count]); count++)
+					;
+				this->emitBatch(block, count);
+			} while (count == EMIT_BATCH);
+		}
+		void backpressure(bool b) { _backpressure = b; }
+		uint32_t overflows() { return _ring.overflows(); }
+		uint32_t demand() {
+			if (!_backpressure)
+				return UINT32_MAX;
+			return _ring.capacity() - _ring.size();
+		}
+};
+//__________________________________________________________________________`
+//
 // calculates moving average
 // samples : number of samples on which average is calculated
 // timeout : after which time the value is forwarded
@@ -572,6 +1373,19 @@ template <class T> class MovingAverage : public Flow<T, T> {
 				this->emit(average());
 			}
 		}
+		// average is taken over the block, one clock read per block
+		void onNextBatch(const T *values, size_t count) {
+			for (size_t i = 0; i < count; i++) {
+				if (_samples.size() > _sampleCount)
+					_samples.pop_back();
+				_samples.push_front(values[i]);
+			}
+			uint64_t now = Sys::millis();
+			if (count && now > _expTime) {
+				_expTime = now + _interval;
+				this->emit(average());
+			}
+		}
 		void request() { this->emit(average()); }
 };
 //__________________________________________________________________________`
@@ -597,6 +1411,13 @@ template <class T> class ExponentialFilter : public Flow<T, T> {
 			_lastValue = ((_total - _ratio) * _lastValue + _ratio * value) / _total;
 			this->emit(_lastValue);
 		}
+		void onNextBatch(const T *values, size_t count) {
+			BatchEmitter<T> out(*this);
+			for (size_t i = 0; i < count; i++) {
+				_lastValue = ((_total - _ratio) * _lastValue + _ratio * values[i]) / _total;
+				out.add(_lastValue);
+			}
+		}
 		void request() { this->emit(_lastValue); }
 };
 //__________________________________________________________________________`
@@ -613,7 +1434,7 @@ template <class T> class TimeoutFlow : public Flow<T, T> {
 		TimerSource timer;
 		TimeoutFlow(uint32_t timeout, T defaultValue)
 			: _defaultValue(defaultValue), timer(1, timeout, true) {
-			timer >> *new LambdaSink<TimerMsg>(
+			timer >> topology.make<LambdaSink<TimerMsg>>(
 			[&](TimerMsg tm) { this->emit(_defaultValue); });
 		}
 		void onNext(const T &t) {
@@ -0,0 +1,69 @@
+#include "Trace.h"
+#include <atomic>
+#include <stdio.h>
+
+#ifdef STREAMS_TRACE
+
+static TraceEvent traceEvents[TRACE_EVENTS];
+static std::atomic<uint32_t> traceHead(0);
+static std::atomic<bool> traceEnabled(true);
+
+#if defined(__linux__)
+#include <chrono>
+#include <pthread.h>
+#define IRAM_ATTR
+static inline uint32_t traceTime() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+static inline uint32_t traceTask() { return (uint32_t)(uintptr_t)pthread_self(); }
+#else
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+static inline uint32_t traceTime() { return esp_timer_get_time(); }
+static inline uint32_t traceTask() {
+  return xPortInIsrContext() ? 0
+                             : (uint32_t)(uintptr_t)xTaskGetCurrentTaskHandle();
+}
+#endif
+
+// lock free, callable from ISR. When the ring is full the oldest are
+// overwritten.
+void IRAM_ATTR traceRecord(uint8_t kind, uint8_t phase, const void *object) {
+  if (!traceEnabled.load(std::memory_order_relaxed))
+    return;
+  uint32_t index = traceHead.fetch_add(1, std::memory_order_relaxed);
+  TraceEvent &event = traceEvents[index & (TRACE_EVENTS - 1)];
+  event.time = traceTime();
+  event.object = (uint32_t)(uintptr_t)object;
+  event.task = traceTask();
+  event.kind = kind;
+  event.phase = phase;
+}
+
+// recording stops while dumping, oldest event first
+void traceDump() {
+  traceEnabled = false;
+  uint32_t head = traceHead.load();
+  uint32_t first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+  printf("TRACE BEGIN %u\n", head - first);
+  for (uint32_t i = first; i < head; i++) {
+    TraceEvent &event = traceEvents[i & (TRACE_EVENTS - 1)];
+    printf("TRACE %08X %08X %08X %X %X\n", event.time, event.object,
+           event.task, event.kind, event.phase);
+  }
+  printf("TRACE END\n");
+  fflush(stdout);
+  traceHead = 0;
+  traceEnabled = true;
+}
+
+#else
+
+void traceRecord(uint8_t kind, uint8_t phase, const void *object) {}
+void traceDump() { printf("TRACE not compiled in, build with -DSTREAMS_TRACE\n"); }
+
+#endif
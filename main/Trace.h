@@ -0,0 +1,41 @@
+#ifndef TRACE_H
+#define TRACE_H
+//______________________________________________________________________________
+//
+// Trace : binary ring of timestamped enter/exit events of request(), onNext(),
+// timer fires and ISR entries. Compiled in with -DSTREAMS_TRACE, without it
+// the TRACE_ macros expand to nothing.
+//
+// traceDump() prints the ring as hex lines on the console, capture them with
+// 'make term' and convert with bench/trace2chrome to Chrome trace_event JSON
+// ( chrome://tracing or ui.perfetto.dev )
+//
+#include <stdint.h>
+
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS 1024 // power of 2, 16 bytes each
+#endif
+
+typedef enum { TRACE_REQUEST = 0, TRACE_ONNEXT, TRACE_TIMER, TRACE_ISR } TraceKind;
+typedef enum { TRACE_BEGIN = 0, TRACE_END } TracePhase;
+
+struct TraceEvent {
+		uint32_t time;   // usec, wraps after 71 minutes
+		uint32_t object; // address of the requestable, observer, timer or ISR
+		uint32_t task;   // 0 in ISR context
+		uint8_t kind;
+		uint8_t phase;
+};
+
+void traceRecord(uint8_t kind, uint8_t phase, const void *object);
+void traceDump();
+
+#ifdef STREAMS_TRACE
+#define TRACE_ENTER(kind, object) traceRecord(kind, TRACE_BEGIN, object)
+#define TRACE_EXIT(kind, object) traceRecord(kind, TRACE_END, object)
+#else
+#define TRACE_ENTER(kind, object)
+#define TRACE_EXIT(kind, object)
+#endif
+
+#endif // TRACE_H
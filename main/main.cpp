@@ -8,51 +8,20 @@
 #endif
 
 #include <LedBlinker.h>
+#ifdef LIGHT_SLEEP
+// opt-in, needs CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE set
+// through menuconfig, the sdkconfig in the tree has neither.
+// Not for nodes receiving on a UART : bytes arriving in light sleep are lost.
+#include "sdkconfig.h"
+#if !defined(CONFIG_PM_ENABLE) || !defined(CONFIG_FREERTOS_USE_TICKLESS_IDLE)
+#error "LIGHT_SLEEP needs CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE"
+#endif
+#include "esp_pm.h"
+#endif
 #include "freertos/task.h"
 #define STRINGIFY(X) #X
 #define S(X) STRINGIFY(X)
 template <class T>
-class ChangeFlow : public Flow<T, T>
-{
-    T _value;
-    int _delta;
-    bool _emitOnChange = true;
-
-public:
-    ChangeFlow(int delta)
-    {
-        _delta=delta;
-    }
-    /*    ChangeFlow(T x)
-            : Flow<T, T>()
-            , _value(x) {};*/
-    void request()
-    {
-        this->emit(_value);
-    }
-    void onNext(const T& value)
-    {
-        if(_emitOnChange && abs(value - _value)>_delta) {
-            this->emit(value);
-        }
-        _value = value;
-    }
-    void emitOnChange(bool b)
-    {
-        _emitOnChange = b;
-    };
-    inline void operator=(T value)
-    {
-        onNext(value);
-    };
-    inline T operator()()
-    {
-        return _value;
-    }
-};
-//______________________________________________________________________
-//
-template <class T>
 class Wait : public Flow<T, T>
 {
     uint64_t _last;
@@ -94,7 +63,7 @@ public:
     {
         _idx++;
         if(_idx >= _requestables.size()) _idx = 0;
-        if(_requestables.size() && run()) {
+        if(_requestables.size() && run() && _requestables[_idx]->hasDemand()) {
             _requestables[_idx]->request();
         }
     }
@@ -192,6 +161,9 @@ LambdaSource<uint64_t> systemUptime([]()
 Thread mqttThread;
 Thread thisThread;
 Thread motorThread;
+#ifdef EXECUTOR
+Executor executor; // mqtt and servo share both cores, motor stays pinned
+#endif
 
 extern "C" void app_main(void)
 {
@@ -200,15 +172,15 @@ extern "C" void app_main(void)
     Sys::hostname(S(HOSTNAME));
     systemHostname = S(HOSTNAME);
     systemBuild = __DATE__ " " __TIME__;
-    Poller& slowPoller = *new Poller(1000);
-    Poller& rpmPoller = *new Poller(100);
+    Poller& slowPoller = topology.make<Poller>(1000);
+    Poller& rpmPoller = topology.make<Poller>(100);
 
 
 #ifdef MQTT_SERIAL
-    MqttSerial& mqtt = *new MqttSerial();
+    MqttSerial& mqtt = topology.make<MqttSerial>();
 #else
-    Wifi& wifi = *new Wifi();
-    Mqtt& mqtt = *new Mqtt();
+    Wifi& wifi = topology.make<Wifi>();
+    Mqtt& mqtt = topology.make<Mqtt>();
     wifi.connected >> mqtt.wifiConnected;
     wifi.init();
     wifi.ipAddress >> mqtt.toTopic<std::string>("wifi/ipAddress");
@@ -250,21 +222,53 @@ extern "C" void app_main(void)
 
     mqttThread | slowPoller(systemHeap)(systemUptime)(systemBuild)(systemHostname)(dummy);
 
+    ThreadStatsSource& mqttThreadStats = topology.make<ThreadStatsSource>(mqttThread);
+    ThreadStatsSource& thisThreadStats = topology.make<ThreadStatsSource>(thisThread);
+    mqttThreadStats >> mqtt.toTopic<ThreadStats>("system/thread/mqtt");
+    thisThreadStats >> mqtt.toTopic<ThreadStats>("system/thread/main");
+    slowPoller(mqttThreadStats)(thisThreadStats);
+#ifdef LIGHT_SLEEP
+    // tickless idle sleeps until the earliest thread wakeup, timer slack
+    // lets nearby timers share one wakeup
+    esp_pm_config_esp32_t pm;
+    pm.max_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+    pm.min_freq_mhz = 40;
+    pm.light_sleep_enable = true;
+    esp_err_t erc = esp_pm_configure(&pm);
+    if(erc != ESP_OK) WARN(" esp_pm_configure() failed, no light sleep : %d ", erc);
+    slowPoller.slack(100);
+#ifdef LIGHT_SLEEP_DEBUG // costs a wakeup and a transmission every second
+    LambdaSource<uint32_t>& wakeupIn = topology.make<LambdaSource<uint32_t>>([]() {
+        return thisThread.wakeupIn();
+    });
+    wakeupIn >> mqtt.toTopic<uint32_t>("system/wakeupIn");
+    slowPoller(wakeupIn);
+#endif
+#endif
+#ifdef STREAMS_TRACE
+    mqtt.fromTopic<bool>("system/traceDump") >> topology.make<LambdaSink<bool>>([](const bool&) {
+        traceDump(); // on console, blocks mqttThread while printing
+    });
+#endif
+
 #ifdef GPS
     gps.init(); // no thread , driven from interrupt
-    gps >> *new Throttle<MqttMessage>(1000) >> mqtt.outgoing.fromIsr;
+    gps >> topology.make<Throttle<MqttMessage>>(1000) >> mqtt.outgoing.fromIsr;
 
 #endif
 
 #ifdef US
     ultrasonic.init();
     ultrasonic.interval(200);
+#ifdef LIGHT_SLEEP
+    ultrasonic.slack(20);
+#endif
     thisThread | ultrasonic;
     ultrasonic.distance >> mqtt.toTopic<int32_t>("us/distance");
 #endif
 
 #ifdef REMOTE
-    Poller& fastPoller = *new Poller(100);
+    Poller& fastPoller = topology.make<Poller>(100);
     potLeft.init();
     potRight.init();
     buttonLeft.init();
@@ -274,19 +278,21 @@ extern "C" void app_main(void)
 
     thisThread | potLeft.timer;
     thisThread | potRight.timer;
-    potLeft >> *new Median<int, 5>() >> *new Throttle<int>(100) >> *new ChangeFlow<int>(3)  >> mqtt.toTopic<int>("remote/potLeft");             // timer driven
-    potRight >> *new Median<int, 5>() >> *new Throttle<int>(100) >> *new ChangeFlow<int>(3) >> mqtt.toTopic<int>("remote/potRight");           // timer driven
-    buttonLeft >> *new Throttle<bool>(100) >> mqtt.toTopic<bool>("remote/buttonLeft");   // ISR driven
-    buttonRight >> *new Throttle<bool>(100) >> mqtt.toTopic<bool>("remote/buttonRight"); // ISR driven
+    potLeft >> topology.make<Median<int, 5>>() >> topology.make<Throttle<int>>(100) >> topology.make<ChangeFlow<int>>(3)  >> mqtt.toTopic<int>("remote/potLeft");             // timer driven
+    potRight >> topology.make<Median<int, 5>>() >> topology.make<Throttle<int>>(100) >> topology.make<ChangeFlow<int>>(3) >> mqtt.toTopic<int>("remote/potRight");           // timer driven
+    buttonLeft >> topology.make<Throttle<bool>>(100) >> mqtt.toTopic<bool>("remote/buttonLeft");   // ISR driven
+    buttonRight >> topology.make<Throttle<bool>>(100) >> mqtt.toTopic<bool>("remote/buttonRight"); // ISR driven
     mqtt.topic<bool>("remote/ledLeft") >> ledLeft;
     mqtt.topic<bool>("remote/ledRight") >> ledRight;
+    buttonLeft.mailbox(4).observeOn(thisThread); // edges arrive from the gpio ISR
+    buttonRight.mailbox(4).observeOn(thisThread);
     fastPoller(buttonLeft)(buttonRight);
     thisThread | fastPoller;
 #endif
 
 #ifdef MOTOR
-    RotaryEncoder& rotaryEncoder = *new RotaryEncoder(uextMotor.toPin(LP_SCL), uextMotor.toPin(LP_SDA));
-    MotorSpeed& motor = *new MotorSpeed(&uextMotor); // cannot init as global var because of NVS
+    RotaryEncoder& rotaryEncoder = topology.make<RotaryEncoder>(uextMotor.toPin(LP_SCL), uextMotor.toPin(LP_SDA));
+    MotorSpeed& motor = topology.make<MotorSpeed>(&uextMotor); // cannot init as global var because of NVS
     INFO(" init motor ");
     rotaryEncoder.init();
     rotaryEncoder.observeOn(motorThread);
@@ -294,8 +300,8 @@ extern "C" void app_main(void)
     rotaryEncoder.isrCounter >> mqtt.toTopic<uint32_t>("motor/isrCounter");
 
     motor.init();
-    motor.pwm >> *new Throttle<float>(100) >> mqtt.toTopic<float>("motor/pwm");
-    motor.rpmMeasured >> *new Throttle<int>(100) >> mqtt.toTopic<int>("motor/rpmMeasured");
+    motor.pwm >> topology.make<Throttle<float>>(100) >> mqtt.toTopic<float>("motor/pwm");
+    motor.rpmMeasured >> topology.make<Throttle<int>>(100) >> mqtt.toTopic<int>("motor/rpmMeasured");
     rpmPoller(rotaryEncoder.rpmMeasured);
     motorThread | rpmPoller;
 
@@ -308,6 +314,10 @@ extern "C" void app_main(void)
     motor.deviceMessage >> mqtt.toTopic<std::string>("motor/message");
     slowPoller(motor.KI)(motor.KP)(motor.KD)(motor.rpmTarget)(motor.deviceMessage)(motor.running)(rotaryEncoder.isrCounter)(motor.rpmMeasured);
 
+    ThreadStatsSource& motorThreadStats = topology.make<ThreadStatsSource>(motorThread);
+    motorThreadStats >> mqtt.toTopic<ThreadStats>("system/thread/motor");
+    slowPoller(motorThreadStats);
+
     motor.observeOn(motorThread);
     xTaskCreatePinnedToCore([](void*) {
         INFO("motorThread started.");
@@ -316,10 +326,10 @@ extern "C" void app_main(void)
 #endif
 
 #ifdef SERVO
-    MotorServo& servo = *new MotorServo(&uextServo);
+    MotorServo& servo = topology.make<MotorServo>(&uextServo);
     servo.init();
-    servo.pwm >> *new Throttle<float>(100) >> mqtt.toTopic<float>("servo/pwm");
-    servo.angleMeasured >> *new Throttle<int>(100) >> mqtt.toTopic<int>("servo/angleMeasured");
+    servo.pwm >> topology.make<Throttle<float>>(100) >> mqtt.toTopic<float>("servo/pwm");
+    servo.angleMeasured >> topology.make<Throttle<int>>(100) >> mqtt.toTopic<int>("servo/angleMeasured");
     servo.KI == mqtt.topic<float>("servo/KI");
     servo.KP == mqtt.topic<float>("servo/KP");
     servo.KD == mqtt.topic<float>("servo/KD");
@@ -329,18 +339,36 @@ extern "C" void app_main(void)
     servo.deviceMessage >> mqtt.toTopic<std::string>("servo/message");
     slowPoller(servo.KI)(servo.KP)(servo.KD)(servo.angleTarget)(servo.deviceMessage)(servo.running);
 
+    ThreadStatsSource& servoThreadStats = topology.make<ThreadStatsSource>(servoThread);
+    servoThreadStats >> mqtt.toTopic<ThreadStats>("system/thread/servo");
+    slowPoller(servoThreadStats);
+
     servo.observeOn(servoThread);
+#ifdef EXECUTOR
+    executor.add(servoThread);
+#else
     xTaskCreatePinnedToCore([](void*) {
         INFO("servoThread started.");
         servoThread.run();
     }, "servo", 20000, NULL, 17, NULL, APP_CPU);
 #endif
+#endif
 
+#ifdef EXECUTOR
+    executor.add(mqttThread);
+    executor.start(20000, 17);
+#else
     xTaskCreatePinnedToCore([](void*) {
         INFO("mqttThread started.");
         mqttThread.run();
     }, "mqtt", 20000, NULL, 17, NULL, PRO_CPU);
+#endif
 
+    topology.seal(); // topology complete, no more nodes from here
+    if(topology.overflow()) // TOPOLOGY_ARENA_SIZE too small for this node
+        WARN(" topology arena : %u/%u bytes used, %u from heap ", topology.used(), topology.size(), topology.overflow());
+    else
+        INFO(" topology arena : %u/%u bytes used ", topology.used(), topology.size());
     thisThread.run();
     // DON'T EXIT , local varaibale will be destroyed
 }